@@ -4,24 +4,87 @@
 set -euo pipefail
 
 usage() {
-	echo "Usage: $0 [-n nr_samples] [-p percentile] [-t]" >&2
+	echo "Usage: $0 [-n nr_samples] [-p percentile] [-t] [-c] [-f filter]... [-g trigger]... [-k] [-C] [-b sizes] [-r] [-F] [-P] [-L] [-l group_size [-o placement]] [-s] [-x] [-q] [-S policy]" >&2
 	echo "  -t  enable preemptirq tracepoints before benchmarking" >&2
+	echo "  -c  run once per tracepoint consumer (none probe ftrace perf bpf)" >&2
+	echo "  -f  compare enabled events with and without this filter (repeatable)" >&2
+	echo "  -g  compare enabled events with and without this trigger (repeatable)" >&2
+	echo "  -k  run once per attach mechanism (none kprobe kretprobe fprobe ftrace_ops)" >&2
+	echo "  -C  run with enabled events once per trace clock (local global counter mono x86-tsc)" >&2
+	echo "  -b  run with enabled events once per ring buffer size (KB) and mode" >&2
+	echo "  -r  drain the ring buffer through trace_pipe during -b runs" >&2
+	echo "  -F  run once per function tracer (nop function function_graph) filtered to the module" >&2
+	echo "  -P  run untraced and traced once per preemption model (none voluntary full lazy)" >&2
+	echo "  -L  run once per latency tracer (nop irqsoff preemptoff preemptirqsoff wakeup*)" >&2
+	echo "  -l  run untraced and traced with CPU groups of this size contending on spinlocks" >&2
+	echo "  -o  lock group placement for -l (linear package spread)" >&2
+	echo "  -s  also measure the slow paths of the enable primitives (pending irq, resched, softirq)" >&2
+	echo "  -x  also sample from interrupt context (hardirq softirq)" >&2
+	echo "  -q  run the quick canary check only, exit status 2 on failure" >&2
+	echo "  -S  scheduling policy of the sampling threads (normal fifo deadline)" >&2
 	exit 1
 }
 
 NR_SAMPLES=100000
 PERCENTILE=99
 ENABLE_TRACEPOINTS=0
+BUFFER_SIZES=""
+DRAIN_BUFFER=0
+LOCK_GROUP_SIZE=0
+LOCK_PLACEMENT=linear
+SLOW_PATHS=0
+CONTEXTS=0
+POLICY=normal
+FILTERS=()
+TRIGGERS=()
 
-while getopts "n:p:th" opt; do
+# The sweep to run, empty for a single run.  Sweeps manage the tracing
+# state themselves, so only one can be selected and not together with -t.
+MODE=""
+
+set_mode() {
+	if [ -n "$MODE" ] && [ "$MODE" != "$1" ]; then
+		echo "error: only one sweep option can be given" >&2
+		exit 1
+	fi
+	MODE="$1"
+}
+
+while getopts "n:p:tcf:g:kCb:rFPLl:o:sxqS:h" opt; do
 	case $opt in
 	n) NR_SAMPLES="$OPTARG" ;;
 	p) PERCENTILE="$OPTARG" ;;
 	t) ENABLE_TRACEPOINTS=1 ;;
+	c) set_mode consumers ;;
+	f) set_mode filters; FILTERS+=("$OPTARG") ;;
+	g) set_mode filters; TRIGGERS+=("$OPTARG") ;;
+	k) set_mode attach ;;
+	C) set_mode clocks ;;
+	b) set_mode buffers; BUFFER_SIZES="$OPTARG" ;;
+	r) DRAIN_BUFFER=1 ;;
+	F) set_mode ftrace ;;
+	P) set_mode preempt ;;
+	L) set_mode tracers ;;
+	l) set_mode lock; LOCK_GROUP_SIZE="$OPTARG" ;;
+	o) LOCK_PLACEMENT="$OPTARG" ;;
+	s) SLOW_PATHS=1 ;;
+	x) CONTEXTS=1 ;;
+	q) set_mode canary ;;
+	S) POLICY="$OPTARG" ;;
 	*) usage ;;
 	esac
 done
 
+if [ "$DRAIN_BUFFER" -eq 1 ] && [ "$MODE" != "buffers" ]; then
+	echo "error: -r requires -b" >&2
+	exit 1
+fi
+
+if [ "$ENABLE_TRACEPOINTS" -eq 1 ] && [ -n "$MODE" ]; then
+	echo "error: -t cannot be combined with a sweep option" >&2
+	exit 1
+fi
+
 DEBUGFS_ROOT="/sys/kernel/debug"
 DEBUGFS="$DEBUGFS_ROOT/tracerbench"
 
@@ -42,41 +105,282 @@ fi
 KVER="$(uname -r)"
 ARCH="$(uname -m)"
 
-TRACING="$DEBUGFS_ROOT/tracing/events/preemptirq"
+TRACEFS="$DEBUGFS_ROOT/tracing"
+TRACING="$TRACEFS/events/preemptirq"
+EVENTS="irq_disable irq_enable preempt_disable preempt_enable"
+
+# Also tell the module what to expect, so that it can flag runs whose
+# tracepoints did not actually fire
+set_tracepoints() {
+	for event in $EVENTS; do
+		echo "$1" > "$TRACING/$event/enable"
+	done
+	echo "$1" > "$DEBUGFS/expect_traced"
+}
 
 disable_tracepoints() {
 	if [ "$ENABLE_TRACEPOINTS" -eq 1 ] && [ -d "$TRACING" ]; then
-		echo 0 > "$TRACING/irq_disable/enable"
-		echo 0 > "$TRACING/irq_enable/enable"
-		echo 0 > "$TRACING/preempt_disable/enable"
-		echo 0 > "$TRACING/preempt_enable/enable"
+		set_tracepoints 0
+	fi
+}
+
+# The module cannot load BPF programs, so the bpf consumer is a bpftrace
+# raw_tp program attached to the preemptirq events for the duration of
+# the run.
+BPF_PID=""
+BPF_LOG=""
+
+start_bpf() {
+	local probes=""
+
+	if ! command -v bpftrace > /dev/null; then
+		echo "warning: bpftrace not found, skipping bpf consumer" >&2
+		return 1
+	fi
+
+	for event in $EVENTS; do
+		probes="${probes:+$probes, }rawtracepoint:$event"
+	done
+
+	BPF_LOG="$(mktemp)"
+	bpftrace -e "$probes { }" > "$BPF_LOG" 2>&1 &
+	BPF_PID=$!
+
+	# Wait until the probes are attached
+	for _ in $(seq 50); do
+		if grep -q "^Attaching" "$BPF_LOG"; then
+			sleep 1
+			return 0
+		fi
+		kill -0 "$BPF_PID" 2> /dev/null || break
+		sleep 0.2
+	done
+
+	echo "warning: bpftrace failed to attach, skipping bpf consumer" >&2
+	cat "$BPF_LOG" >&2
+	stop_bpf
+	return 1
+}
+
+stop_bpf() {
+	if [ -n "$BPF_PID" ]; then
+		kill "$BPF_PID" 2> /dev/null || true
+		wait "$BPF_PID" 2> /dev/null || true
+		rm -f "$BPF_LOG"
+		BPF_PID=""
+	fi
+}
+
+# Filters and triggers currently applied to the preemptirq events
+ACTIVE_FILTER=""
+ACTIVE_TRIGGER=""
+
+set_filter() {
+	for event in $EVENTS; do
+		echo "$1" > "$TRACING/$event/filter"
+	done
+	ACTIVE_FILTER="$1"
+}
+
+clear_filter() {
+	if [ -n "$ACTIVE_FILTER" ]; then
+		for event in $EVENTS; do
+			echo 0 > "$TRACING/$event/filter"
+		done
+		ACTIVE_FILTER=""
 	fi
 }
 
-if [ "$ENABLE_TRACEPOINTS" -eq 1 ] && [ -d "$TRACING" ]; then
-	trap disable_tracepoints EXIT
-	echo 1 > "$TRACING/irq_disable/enable"
-	echo 1 > "$TRACING/irq_enable/enable"
-	echo 1 > "$TRACING/preempt_disable/enable"
-	echo 1 > "$TRACING/preempt_enable/enable"
+set_trigger() {
+	for event in $EVENTS; do
+		echo "$1" >> "$TRACING/$event/trigger"
+	done
+	ACTIVE_TRIGGER="$1"
+}
+
+clear_trigger() {
+	if [ -n "$ACTIVE_TRIGGER" ]; then
+		for event in $EVENTS; do
+			echo "!$ACTIVE_TRIGGER" >> "$TRACING/$event/trigger"
+		done
+		ACTIVE_TRIGGER=""
+	fi
+}
+
+# The selected entry of a tracefs file listing choices as "a [b] c"
+current_choice() {
+	sed -e 's/.*\[\(.*\)\].*/\1/' "$1"
+}
+
+# Also accepts the "a (b) c" format of sched/preempt
+has_choice() {
+	tr -d '[]()' < "$1" | tr ' ' '\n' | grep -qx "$2"
+}
+
+ORIG_CLOCK=""
+
+restore_clock() {
+	if [ -n "$ORIG_CLOCK" ]; then
+		echo "$ORIG_CLOCK" > "$TRACEFS/trace_clock"
+		ORIG_CLOCK=""
+	fi
+}
+
+ORIG_BUFFER_SIZE=""
+ORIG_OVERWRITE=""
+READER_PID=""
+
+restore_buffer() {
+	if [ -n "$ORIG_BUFFER_SIZE" ]; then
+		echo "$ORIG_BUFFER_SIZE" > "$TRACEFS/buffer_size_kb"
+		echo "$ORIG_OVERWRITE" > "$TRACEFS/options/overwrite"
+		ORIG_BUFFER_SIZE=""
+	fi
+}
+
+start_reader() {
+	cat "$TRACEFS/trace_pipe" > /dev/null &
+	READER_PID=$!
+}
+
+stop_reader() {
+	if [ -n "$READER_PID" ]; then
+		kill "$READER_PID" 2> /dev/null || true
+		wait "$READER_PID" 2> /dev/null || true
+		READER_PID=""
+	fi
+}
+
+# Events lost over all CPUs: overwritten in overwrite mode, or rejected
+# because the buffer was full in producer/consumer mode
+lost_events() {
+	awk '/^(overrun|dropped events):/ { n += $NF } END { print n + 0 }' \
+		"$TRACEFS"/per_cpu/cpu*/stats
+}
+
+# Function traced by the fentry_ref primitive
+TRACED_FN="tracerbench_traced_fn"
+ORIG_TRACER=""
+FTRACE_FILTER_SET=0
+
+restore_tracer() {
+	if [ -n "$ORIG_TRACER" ]; then
+		echo "$ORIG_TRACER" > "$TRACEFS/current_tracer"
+		ORIG_TRACER=""
+	fi
+	if [ "$FTRACE_FILTER_SET" -eq 1 ]; then
+		echo > "$TRACEFS/set_ftrace_filter"
+		FTRACE_FILTER_SET=0
+	fi
+}
+
+# PREEMPT_DYNAMIC preemption model
+SCHED_PREEMPT="$DEBUGFS_ROOT/sched/preempt"
+ORIG_MODEL=""
+
+# The current model, which sched/preempt lists as "a (b) c"
+current_model() {
+	sed -n -e 's/.*(\(.*\)).*/\1/p' "$SCHED_PREEMPT"
+}
+
+restore_model() {
+	if [ -n "$ORIG_MODEL" ]; then
+		if ! echo "$ORIG_MODEL" > "$SCHED_PREEMPT"; then
+			echo "warning: cannot restore preemption model $ORIG_MODEL" >&2
+		fi
+		ORIG_MODEL=""
+	fi
+}
+
+cleanup() {
+	stop_bpf
+	restore_model
+	restore_tracer
+	stop_reader
+	restore_buffer
+	restore_clock
+	clear_filter
+	clear_trigger
+	echo none > "$DEBUGFS/consumer"
+	echo none > "$DEBUGFS/attach"
+	echo 0 > "$DEBUGFS/expect_traced"
+	echo 0 > "$DEBUGFS/latency_tracer"
+	echo 0 > "$DEBUGFS/lock_group_size"
+	echo 0 > "$DEBUGFS/irq_pending"
+	echo 0 > "$DEBUGFS/resched_pending"
+	echo 0 > "$DEBUGFS/bh_pending"
+	echo 0 > "$DEBUGFS/hardirq_sampling"
+	echo 0 > "$DEBUGFS/softirq_sampling"
+	echo normal > "$DEBUGFS/sched_policy"
+	disable_tracepoints
+}
+
+trap cleanup EXIT
+
+if [ "$ENABLE_TRACEPOINTS" -eq 1 ]; then
+	if [ ! -d "$TRACING" ]; then
+		echo "error: $TRACING not found" >&2
+		exit 1
+	fi
+	set_tracepoints 1
 fi
 
 echo "$NR_SAMPLES" > "$DEBUGFS/nr_samples"
 echo "$PERCENTILE" > "$DEBUGFS/nth_percentile"
 echo Y > "$DEBUGFS/do_work"
-echo 1 > "$DEBUGFS/benchmark"
-
-disable_tracepoints
+echo "$POLICY" > "$DEBUGFS/sched_policy"
 
 read_val() {
-	cat "$DEBUGFS/$1/$2"
+	if [ -f "$DEBUGFS/$1/$2" ]; then
+		cat "$DEBUGFS/$1/$2"
+	else
+		echo "-"
+	fi
 }
 
-STATS="irq preempt irq_save"
-FIELDS="median average percentile"
+STATS="irq preempt irq_save raw_irq raw_preempt raw_irq_save tp_ref0 tp_ref1 tp_refn fentry_ref"
+FIELDS="median average percentile instrumentation_delta"
+
+# Slow path benchmarks, each also reports how many samples missed it
+SLOW_STATS="irq_pending resched_pending bh_pending"
+
+if [ "$SLOW_PATHS" -eq 1 ]; then
+	for stat in $SLOW_STATS; do
+		echo 1 > "$DEBUGFS/$stat"
+	done
+	STATS="$STATS $SLOW_STATS"
+fi
+
+if [ "$CONTEXTS" -eq 1 ]; then
+	echo 1 > "$DEBUGFS/hardirq_sampling"
+	echo 1 > "$DEBUGFS/softirq_sampling"
+	STATS="$STATS hardirq/preempt hardirq/irq_save"
+	STATS="$STATS softirq/irq softirq/preempt softirq/irq_save"
+fi
 
 UNIT="(cycles)"
 
+# Medians of a reference run, used to add a "vs-base" column to the
+# tables printed after it
+declare -A BASELINE=()
+
+save_baseline() {
+	for stat in $STATS; do
+		BASELINE[$stat]="$(read_val "$stat" median)"
+	done
+}
+
+vs_baseline() {
+	local val
+
+	val="$(read_val "$1" median)"
+	if [ "$val" == "-" ] || [ "${BASELINE[$1]:--}" == "-" ]; then
+		echo "-"
+	else
+		echo $((val - BASELINE[$1]))
+	fi
+}
+
 # Compute first column width from the widest label
 COL1=${#KVER}
 for s in $ARCH $STATS; do
@@ -84,32 +388,328 @@ for s in $ARCH $STATS; do
 done
 COL1=$((COL1 + 2))
 
-printf "%-${COL1}s" "$KVER"
-for field in $FIELDS; do
-    if [ "$field" == "percentile" ]; then
-        printf "%15s" "$PERCENTILE-$field"
-    else
-	    printf "%15s" "$field"
+# Tracepoint hits counted by the module after the run
+print_verification() {
+	printf "tracepoint hits (observed/expected):"
+	for stat in irq preempt irq_save; do
+		printf " %s %s/%s" "$stat" "$(read_val "$stat" tp_observed)" \
+			"$(read_val "$stat" tp_expected)"
+	done
+	printf "\n"
+
+	awk '{ v += $2; i += $3 } END {
+		printf "context switches (%s CPUs): voluntary %d involuntary %d\n", NR, v, i
+	}' "$DEBUGFS/context_switches"
+	echo "yields between chunks: $(cat "$DEBUGFS/yields")"
+	echo "participating CPUs: $(cat "$DEBUGFS/participating_cpus")"
+	awk '$2 != "completed" { print "  CPU " $1 ": " $2 " (" $3 " samples)" }' \
+		"$DEBUGFS/participation"
+
+	if [ "$SLOW_PATHS" -eq 1 ]; then
+		printf "slow path samples missed:"
+		for stat in $SLOW_STATS; do
+			printf " %s %s" "$stat" "$(read_val "$stat" missed)"
+		done
+		printf "\n"
 	fi
-done
-printf "\n"
 
-printf "%-${COL1}s" "$ARCH"
-for field in $FIELDS; do
-	printf "%15s" "$UNIT"
-done
-printf "\n"
+	if [ "$(cat "$DEBUGFS/trace_mismatch")" -ne 0 ]; then
+		echo "WARNING: tracepoint state does not match the requested run" >&2
+	fi
+}
 
-printf "%-${COL1}s" "--------"
-for field in $FIELDS; do
-	printf "%15s" "--------"
-done
-printf "\n"
+print_table() {
+	printf "%-${COL1}s" "$KVER"
+	for field in $FIELDS; do
+		if [ "$field" == "percentile" ]; then
+			printf "%15s" "$PERCENTILE-$field"
+		elif [ "$field" == "instrumentation_delta" ]; then
+			printf "%15s" "delta"
+		else
+			printf "%15s" "$field"
+		fi
+	done
+	[ ${#BASELINE[@]} -gt 0 ] && printf "%15s" "vs-base"
+	printf "\n"
 
-for stat in $STATS; do
-	printf "%-${COL1}s" "$stat"
+	printf "%-${COL1}s" "$ARCH"
 	for field in $FIELDS; do
-		printf "%15s" "$(read_val "$stat" "$field")"
+		printf "%15s" "$UNIT"
 	done
+	[ ${#BASELINE[@]} -gt 0 ] && printf "%15s" "$UNIT"
 	printf "\n"
-done
+
+	printf "%-${COL1}s" "--------"
+	for field in $FIELDS; do
+		printf "%15s" "--------"
+	done
+	[ ${#BASELINE[@]} -gt 0 ] && printf "%15s" "--------"
+	printf "\n"
+
+	for stat in $STATS; do
+		printf "%-${COL1}s" "$stat"
+		for field in $FIELDS; do
+			printf "%15s" "$(read_val "$stat" "$field")"
+		done
+		[ ${#BASELINE[@]} -gt 0 ] && printf "%15s" "$(vs_baseline "$stat")"
+		printf "\n"
+	done
+
+	print_verification
+}
+
+run_benchmark() {
+	echo 1 > "$DEBUGFS/benchmark"
+}
+
+case "$MODE" in
+canary)
+	result="$(cat "$DEBUGFS/canary")"
+	echo "$result"
+	[ "${result%% *}" == "PASS" ] || exit 2
+	exit 0
+	;;
+consumers)
+	for consumer in none probe ftrace perf bpf; do
+		if [ "$consumer" == "bpf" ]; then
+			start_bpf || continue
+			echo none > "$DEBUGFS/consumer"
+			echo 1 > "$DEBUGFS/expect_traced"
+		else
+			echo "$consumer" > "$DEBUGFS/consumer"
+		fi
+
+		run_benchmark
+		stop_bpf
+		echo 0 > "$DEBUGFS/expect_traced"
+
+		printf "\nconsumer: %s\n" "$consumer"
+		print_table
+	done
+	exit 0
+	;;
+filters)
+	if [ ! -d "$TRACING" ]; then
+		echo "error: $TRACING not found" >&2
+		exit 1
+	fi
+
+	ENABLE_TRACEPOINTS=1
+	set_tracepoints 1
+
+	run_benchmark
+	printf "\nunfiltered\n"
+	print_table
+	save_baseline
+
+	for filter in ${FILTERS[@]+"${FILTERS[@]}"}; do
+		set_filter "$filter"
+		run_benchmark
+		clear_filter
+		printf "\nfilter: %s\n" "$filter"
+		print_table
+	done
+
+	for trigger in ${TRIGGERS[@]+"${TRIGGERS[@]}"}; do
+		set_trigger "$trigger"
+		run_benchmark
+		clear_trigger
+		printf "\ntrigger: %s\n" "$trigger"
+		print_table
+	done
+	exit 0
+	;;
+attach)
+	for mechanism in none kprobe kretprobe fprobe ftrace_ops; do
+		echo "$mechanism" > "$DEBUGFS/attach"
+		if ! run_benchmark; then
+			# kprobes cannot hook the NOKPROBE_SYMBOL tracing functions
+			echo "warning: cannot attach $mechanism, skipping" >&2
+			continue
+		fi
+
+		printf "\nattach: %s (%s sites)\n" "$mechanism" \
+			"$(cat "$DEBUGFS/attach_sites")"
+		print_table
+		[ "$mechanism" == "none" ] && save_baseline
+	done
+	exit 0
+	;;
+clocks)
+	if [ ! -d "$TRACING" ]; then
+		echo "error: $TRACING not found" >&2
+		exit 1
+	fi
+
+	ORIG_CLOCK="$(current_choice "$TRACEFS/trace_clock")"
+	ENABLE_TRACEPOINTS=1
+	set_tracepoints 1
+
+	for clock in local global counter mono x86-tsc; do
+		if ! has_choice "$TRACEFS/trace_clock" "$clock"; then
+			echo "warning: trace clock $clock not available, skipping" >&2
+			continue
+		fi
+
+		echo "$clock" > "$TRACEFS/trace_clock"
+
+		run_benchmark
+
+		printf "\ntrace clock: %s\n" "$clock"
+		print_table
+		[ ${#BASELINE[@]} -eq 0 ] && save_baseline
+	done
+	exit 0
+	;;
+buffers)
+	if [ ! -d "$TRACING" ]; then
+		echo "error: $TRACING not found" >&2
+		exit 1
+	fi
+
+	# Reads as "7 (expanded: 1408)" until the buffer is first used
+	ORIG_BUFFER_SIZE="$(sed -e 's/.*expanded: \([0-9]*\).*/\1/' \
+		"$TRACEFS/buffer_size_kb")"
+	ORIG_OVERWRITE="$(cat "$TRACEFS/options/overwrite")"
+	ENABLE_TRACEPOINTS=1
+
+	for size in ${BUFFER_SIZES//,/ }; do
+		for overwrite in 1 0; do
+			set_tracepoints 0
+			echo "$size" > "$TRACEFS/buffer_size_kb"
+			echo "$overwrite" > "$TRACEFS/options/overwrite"
+			# Clearing the buffer also resets the lost event counters
+			echo > "$TRACEFS/trace"
+			[ "$DRAIN_BUFFER" -eq 1 ] && start_reader
+			set_tracepoints 1
+
+			run_benchmark
+
+			set_tracepoints 0
+			stop_reader
+
+			printf "\nbuffer: %s KB, %s%s, lost events: %s\n" "$size" \
+				"$([ "$overwrite" -eq 1 ] && echo overwrite || echo producer/consumer)" \
+				"$([ "$DRAIN_BUFFER" -eq 1 ] && echo ", drained")" \
+				"$(lost_events)"
+			print_table
+			[ ${#BASELINE[@]} -eq 0 ] && save_baseline
+		done
+	done
+	exit 0
+	;;
+ftrace)
+	if ! grep -q "^$TRACED_FN " "$TRACEFS/available_filter_functions"; then
+		echo "error: $TRACED_FN is not traceable" >&2
+		exit 1
+	fi
+
+	ORIG_TRACER="$(cat "$TRACEFS/current_tracer")"
+	echo "$TRACED_FN" > "$TRACEFS/set_ftrace_filter"
+	FTRACE_FILTER_SET=1
+
+	for tracer in nop function function_graph; do
+		if ! grep -qw "$tracer" "$TRACEFS/available_tracers"; then
+			echo "warning: tracer $tracer not available, skipping" >&2
+			continue
+		fi
+
+		echo "$tracer" > "$TRACEFS/current_tracer"
+		run_benchmark
+		echo nop > "$TRACEFS/current_tracer"
+
+		printf "\ncurrent_tracer: %s\n" "$tracer"
+		print_table
+		[ "$tracer" == "nop" ] && save_baseline
+	done
+	exit 0
+	;;
+preempt)
+	if [ ! -f "$SCHED_PREEMPT" ]; then
+		echo "error: $SCHED_PREEMPT not found, is the kernel PREEMPT_DYNAMIC?" >&2
+		exit 1
+	fi
+
+	ORIG_MODEL="$(current_model)"
+	if [ -z "$ORIG_MODEL" ]; then
+		echo "error: cannot parse the current model in $SCHED_PREEMPT" >&2
+		exit 1
+	fi
+	ENABLE_TRACEPOINTS=1
+
+	for model in none voluntary full lazy; do
+		if ! has_choice "$SCHED_PREEMPT" "$model"; then
+			echo "warning: preemption model $model not available, skipping" >&2
+			continue
+		fi
+
+		echo "$model" > "$SCHED_PREEMPT"
+
+		BASELINE=()
+		run_benchmark
+		printf "\npreempt: %s, untraced\n" "$model"
+		print_table
+		save_baseline
+
+		if [ -d "$TRACING" ]; then
+			set_tracepoints 1
+			run_benchmark
+			set_tracepoints 0
+			printf "\npreempt: %s, traced\n" "$model"
+			print_table
+		fi
+	done
+	exit 0
+	;;
+tracers)
+	ORIG_TRACER="$(cat "$TRACEFS/current_tracer")"
+
+	for tracer in nop irqsoff preemptoff preemptirqsoff wakeup wakeup_rt wakeup_dl; do
+		if ! grep -qw "$tracer" "$TRACEFS/available_tracers"; then
+			echo "warning: tracer $tracer not available, skipping" >&2
+			continue
+		fi
+
+		case "$tracer" in
+		irqsoff|preemptoff|preemptirqsoff)
+			echo 1 > "$DEBUGFS/latency_tracer" ;;
+		esac
+
+		echo "$tracer" > "$TRACEFS/current_tracer"
+		echo 0 > "$TRACEFS/tracing_max_latency"
+		run_benchmark
+		max_latency="$(cat "$TRACEFS/tracing_max_latency")"
+		echo nop > "$TRACEFS/current_tracer"
+		echo 0 > "$DEBUGFS/latency_tracer"
+
+		printf "\ncurrent_tracer: %s, max latency: %s us\n" "$tracer" "$max_latency"
+		print_table
+		[ "$tracer" == "nop" ] && save_baseline
+	done
+	exit 0
+	;;
+lock)
+	echo "$LOCK_GROUP_SIZE" > "$DEBUGFS/lock_group_size"
+	echo "$LOCK_PLACEMENT" > "$DEBUGFS/lock_placement"
+	STATS="lock_acquire lock_hold $STATS"
+	ENABLE_TRACEPOINTS=1
+
+	run_benchmark
+	printf "\nlock groups: %s CPUs, %s, untraced\n" "$LOCK_GROUP_SIZE" "$LOCK_PLACEMENT"
+	print_table
+	save_baseline
+
+	if [ -d "$TRACING" ]; then
+		set_tracepoints 1
+		run_benchmark
+		set_tracepoints 0
+		printf "\nlock groups: %s CPUs, %s, traced\n" "$LOCK_GROUP_SIZE" "$LOCK_PLACEMENT"
+		print_table
+	fi
+	exit 0
+	;;
+esac
+
+run_benchmark
+disable_tracepoints
+print_table
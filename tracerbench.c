@@ -7,14 +7,38 @@
  * overhead introduced by the IRQ and preempt tracepoints in the kernel.
  *
  * Implementation:
- * - Creates one worker thread per CPU
+ * - Creates one worker thread per CPU at load time, woken for each run
+ *   with a configurable scheduling policy
+ * - Sampling is split into chunks of bounded duration, with the thread
+ *   yielding (and optionally sleeping, to bound its duty cycle) between
+ *   them
  * - Each thread performs the following sequence "nr_samples" times:
  *   1. Disables local interrupts (local_irq_disable)
  *   2. Enables local interrupts (local_irq_enable)
  *   3. Disables preemption (preempt_disable)
  *   4. Enables preemption (preempt_enable)
  *   5. Saves and restores local interrupts (local_irq_save/restore)
- * - Tracks execution times (in CPU cycles via get_cycles()) across all CPUs
+ * - Each instrumented pair is interleaved with its raw/notrace counterpart
+ *   (raw_local_irq_*, preempt_*_notrace) so the tracepoint overhead can be
+ *   derived from a single run
+ * - Module-local reference tracepoints with 0, 1 and N probes attached
+ *   calibrate the cost of the generic tracepoint machinery
+ * - A traceable noinline function gives a function tracer (fentry) reference
+ * - Optionally, groups of CPUs contend on shared spinlocks taken with
+ *   spin_lock_irqsave() to measure acquisition and hold times
+ * - Optionally, the slow paths of local_irq_enable() with a pending
+ *   interrupt, of preempt_enable() with a pending reschedule and of
+ *   local_bh_enable() with a pending softirq are measured separately
+ * - Optionally, blocks of preempt and irq save/restore samples are taken
+ *   from hardirq context, and blocks of all three instrumented primitives
+ *   from softirq context
+ * - Writing to the "sample" file runs the instrumented primitives and
+ *   their raw counterparts in the context of the writing task, and
+ *   reading it back returns their histograms
+ * - Reading the "canary" file runs a few hundred samples on a rotating
+ *   subset of CPUs and reports pass/fail against a threshold
+ * - Tracks execution times (in CPU cycles via get_cycles(), or the PMU
+ *   cycle counter on arm64) across all CPUs
  *
  * The collected data helps analyze the worst-case latency impacts of these
  * operations when tracing is active.  Results are reported in raw CPU
@@ -34,6 +58,7 @@
 #include <linux/kthread.h>
 #include <linux/smpboot.h>
 #include <linux/completion.h>
+#include <linux/atomic.h>
 #include <linux/overflow.h>
 #include <linux/sort.h>
 #include <linux/minmax.h>
@@ -42,6 +67,34 @@
 #include <linux/debugfs.h>
 #include <linux/mutex.h>
 #include <linux/min_heap.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/tracepoint.h>
+#include <linux/trace_events.h>
+#include <linux/perf_event.h>
+#include <linux/kprobes.h>
+#include <linux/fprobe.h>
+#include <linux/ftrace.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/topology.h>
+#include <linux/irq_work.h>
+#include <linux/interrupt.h>
+#include <linux/bottom_half.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+#include <linux/sched/clock.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+#ifdef CONFIG_ARM64
+#include <asm/arch_timer.h>
+#include <asm/sysreg.h>
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "tracerbench_trace.h"
 
 /*
  * Debugfs-writable configuration parameter with a snapshot for benchmark
@@ -56,10 +109,156 @@ struct config {
 	size_t cached;
 };
 
+/* The same for the debugfs booleans that select optional benchmarks */
+struct bool_config {
+	bool val;
+	bool cached;
+};
+
+/*
+ * Config parameter selected by name.  @cfg holds the index into @names.
+ * Reading the debugfs file lists every choice with the current one in
+ * brackets, like tracefs' current_tracer.
+ */
+struct choice {
+	struct config cfg;
+	const char * const *names;
+	size_t nr_names;
+};
+
+/*
+ * Tracepoint consumer attached to the preemptirq events for the duration
+ * of a benchmark run.
+ */
+enum consumer {
+	CONSUMER_NONE,
+	CONSUMER_PROBE,
+	CONSUMER_FTRACE,
+	CONSUMER_PERF,
+	NR_CONSUMERS,
+};
+
+static const char * const consumer_names[NR_CONSUMERS] = {
+	[CONSUMER_NONE]		= "none",
+	[CONSUMER_PROBE]	= "probe",
+	[CONSUMER_FTRACE]	= "ftrace",
+	[CONSUMER_PERF]		= "perf",
+};
+
+/*
+ * Mechanism used to hook the functions behind the preemptirq tracepoints
+ * (see attach_symbols[]) with an empty handler during a benchmark run.
+ */
+enum attach {
+	ATTACH_NONE,
+	ATTACH_KPROBE,
+	ATTACH_KRETPROBE,
+	ATTACH_FPROBE,
+	ATTACH_FTRACE_OPS,
+	NR_ATTACH,
+};
+
+/*
+ * How CPUs are assigned to spinlock groups in the lock contention
+ * benchmark.
+ */
+enum placement {
+	PLACEMENT_LINEAR,
+	PLACEMENT_PACKAGE,
+	PLACEMENT_SPREAD,
+	NR_PLACEMENTS,
+};
+
+static const char * const placement_names[NR_PLACEMENTS] = {
+	[PLACEMENT_LINEAR]	= "linear",
+	[PLACEMENT_PACKAGE]	= "package",
+	[PLACEMENT_SPREAD]	= "spread",
+};
+
+/*
+ * Counter used to time the samples.  get_cycles() is the TSC on x86 but
+ * the generic timer on arm64, which ticks at a few tens of MHz, too
+ * coarse for primitives that take a few dozen CPU cycles.
+ */
+enum clock_source {
+	CLKSRC_GET_CYCLES,
+	CLKSRC_PMU,
+	NR_CLOCK_SOURCES,
+};
+
+static const char * const clock_source_names[NR_CLOCK_SOURCES] = {
+	[CLKSRC_GET_CYCLES]	= "get_cycles",
+	[CLKSRC_PMU]		= "pmu",
+};
+
+/* Scheduling policy of the sampling threads during a run */
+enum thread_policy {
+	POLICY_NORMAL,
+	POLICY_FIFO,
+	POLICY_DEADLINE,
+	NR_POLICIES,
+};
+
+static const char * const policy_names[NR_POLICIES] = {
+	[POLICY_NORMAL]		= "normal",
+	[POLICY_FIFO]		= "fifo",
+	[POLICY_DEADLINE]	= "deadline",
+};
+
+static const char * const attach_names[NR_ATTACH] = {
+	[ATTACH_NONE]		= "none",
+	[ATTACH_KPROBE]		= "kprobe",
+	[ATTACH_KRETPROBE]	= "kretprobe",
+	[ATTACH_FPROBE]		= "fprobe",
+	[ATTACH_FTRACE_OPS]	= "ftrace_ops",
+};
+
 static struct config nr_samples = { .val = 10000 };
 static struct config nr_highest = { .val = 100 };
 static struct config nth_percentile = { .val = 99 };
+static struct config nr_ref_probes = { .val = 4 };
+static struct config lock_group_size = { .val = 0 };
+static struct config canary_samples = { .val = 256 };
+static struct config canary_cpus = { .val = 4 };
+static struct config canary_threshold = { .val = 64 };
+static struct config sched_priority = { .val = 50 };
+static struct config dl_runtime_us = { .val = 9000 };
+static struct config dl_period_us = { .val = 10000 };
+static struct config chunk_us = { .val = 10000 };
+static struct config duty_cycle = { .val = 100 };
+static struct choice consumer = {
+	.cfg		= { .val = CONSUMER_NONE },
+	.names		= consumer_names,
+	.nr_names	= NR_CONSUMERS,
+};
+static struct choice attach = {
+	.cfg		= { .val = ATTACH_NONE },
+	.names		= attach_names,
+	.nr_names	= NR_ATTACH,
+};
+static struct choice lock_placement = {
+	.cfg		= { .val = PLACEMENT_LINEAR },
+	.names		= placement_names,
+	.nr_names	= NR_PLACEMENTS,
+};
+static struct choice clock_source = {
+	.cfg		= { .val = IS_ENABLED(CONFIG_ARM64) ? CLKSRC_PMU : CLKSRC_GET_CYCLES },
+	.names		= clock_source_names,
+	.nr_names	= NR_CLOCK_SOURCES,
+};
+static struct choice sched_policy = {
+	.cfg		= { .val = POLICY_NORMAL },
+	.names		= policy_names,
+	.nr_names	= NR_POLICIES,
+};
 static bool do_work;
+static bool expect_traced;
+static bool latency_tracer;
+static struct bool_config irq_pending;
+static struct bool_config resched_pending;
+static struct bool_config bh_pending;
+static struct bool_config hardirq_sampling;
+static struct bool_config softirq_sampling;
 
 DEFINE_MIN_HEAP(u64, u64_min_heap);
 
@@ -81,40 +280,198 @@ struct statistics {
 	.percentile	= 0,		\
 }
 
+/*
+ * Measured primitives.  The instrumented primitives come first and each one
+ * has its raw/notrace counterpart exactly NR_INSTRUMENTED entries later, so
+ * raw_primitive() is a simple offset.  The tracerbench_ref* tracepoints
+ * and the traced function call follow as calibration references, then the
+ * optional benchmarks (see primitive_enabled()).
+ */
+enum primitive {
+	PRIM_IRQ,
+	PRIM_PREEMPT,
+	PRIM_IRQ_SAVE,
+	PRIM_RAW_IRQ,
+	PRIM_RAW_PREEMPT,
+	PRIM_RAW_IRQ_SAVE,
+	PRIM_TP_REF0,
+	PRIM_TP_REF1,
+	PRIM_TP_REFN,
+	PRIM_FENTRY_REF,
+	PRIM_LOCK_ACQUIRE,
+	PRIM_LOCK_HOLD,
+	PRIM_IRQ_PENDING,
+	PRIM_RESCHED_PENDING,
+	PRIM_BH_PENDING,
+	PRIM_HARDIRQ_PREEMPT,
+	PRIM_HARDIRQ_IRQ_SAVE,
+	PRIM_SOFTIRQ_IRQ,
+	PRIM_SOFTIRQ_PREEMPT,
+	PRIM_SOFTIRQ_IRQ_SAVE,
+	NR_PRIMITIVES,
+};
+
+#define NR_INSTRUMENTED PRIM_RAW_IRQ
+
+static inline enum primitive raw_primitive(enum primitive p)
+{
+	return p + NR_INSTRUMENTED;
+}
+
+static const char * const primitive_names[NR_PRIMITIVES] = {
+	[PRIM_IRQ]		= "irq",
+	[PRIM_PREEMPT]		= "preempt",
+	[PRIM_IRQ_SAVE]		= "irq_save",
+	[PRIM_RAW_IRQ]		= "raw_irq",
+	[PRIM_RAW_PREEMPT]	= "raw_preempt",
+	[PRIM_RAW_IRQ_SAVE]	= "raw_irq_save",
+	[PRIM_TP_REF0]		= "tp_ref0",
+	[PRIM_TP_REF1]		= "tp_ref1",
+	[PRIM_TP_REFN]		= "tp_refn",
+	[PRIM_FENTRY_REF]	= "fentry_ref",
+	[PRIM_LOCK_ACQUIRE]	= "lock_acquire",
+	[PRIM_LOCK_HOLD]	= "lock_hold",
+	[PRIM_IRQ_PENDING]	= "irq_pending",
+	[PRIM_RESCHED_PENDING]	= "resched_pending",
+	[PRIM_BH_PENDING]	= "bh_pending",
+	[PRIM_HARDIRQ_PREEMPT]	= "preempt",
+	[PRIM_HARDIRQ_IRQ_SAVE]	= "irq_save",
+	[PRIM_SOFTIRQ_IRQ]	= "irq",
+	[PRIM_SOFTIRQ_PREEMPT]	= "preempt",
+	[PRIM_SOFTIRQ_IRQ_SAVE]	= "irq_save",
+};
+
+/*
+ * Context the samples of a primitive are taken from.  Primitives sampled
+ * outside of the sampling thread are reported in a subdirectory named
+ * after their context.
+ */
+enum context {
+	CTX_TASK,
+	CTX_HARDIRQ,
+	CTX_SOFTIRQ,
+	NR_CONTEXTS,
+};
+
+static const char * const context_names[NR_CONTEXTS] = {
+	[CTX_HARDIRQ]	= "hardirq",
+	[CTX_SOFTIRQ]	= "softirq",
+};
+
+static enum context primitive_context(enum primitive p)
+{
+	switch (p) {
+	case PRIM_HARDIRQ_PREEMPT:
+	case PRIM_HARDIRQ_IRQ_SAVE:
+		return CTX_HARDIRQ;
+	case PRIM_SOFTIRQ_IRQ:
+	case PRIM_SOFTIRQ_PREEMPT:
+	case PRIM_SOFTIRQ_IRQ_SAVE:
+		return CTX_SOFTIRQ;
+	default:
+		return CTX_TASK;
+	}
+}
+
+/* What became of a CPU in the last run */
+enum participation {
+	PART_IDLE,		/* not online when the run started */
+	PART_COMPLETED,
+	PART_REDUCED,		/* completed with fewer samples */
+	PART_NO_MEMORY,		/* could not allocate any sample buffer */
+	PART_OFFLINE,		/* went offline during the run */
+	NR_PARTICIPATION,
+};
+
+static const char * const participation_names[NR_PARTICIPATION] = {
+	[PART_IDLE]		= "idle",
+	[PART_COMPLETED]	= "completed",
+	[PART_REDUCED]		= "reduced",
+	[PART_NO_MEMORY]	= "no_memory",
+	[PART_OFFLINE]		= "offline",
+};
+
 struct percpu_data {
-	struct statistics irq;
-	struct statistics preempt;
-	struct statistics irq_save;
+	struct statistics stat[NR_PRIMITIVES];
+	u64 delta[NR_INSTRUMENTED];
+	/* slow path samples that took the fast path after all */
+	u64 missed[NR_PRIMITIVES];
+	/*
+	 * context switches of the sampling thread while sampling, not
+	 * counting the ones the benchmark causes itself
+	 */
+	u64 nvcsw;
+	u64 nivcsw;
+	/* times the sampling thread yielded between chunks */
+	u64 yields;
+	enum participation status;
+	/* samples per primitive actually taken */
+	size_t nr_samples;
 	bool should_run;
 };
 
 struct debugfs_entry {
 	const char *filename;
-	void *value;
+	size_t offset;
 };
 
-struct debugfs_results {
-	const char *subdir;
-	struct debugfs_entry values[NR_STATISTICS];
+#define STAT_ENTRY(name, field)	{ name, offsetof(struct statistics, field) }
+
+static const struct debugfs_entry debugfs_stat_files[NR_STATISTICS] = {
+	STAT_ENTRY("median",		median),
+	STAT_ENTRY("average",		avg),
+	STAT_ENTRY("max",		max),
+	STAT_ENTRY("max_avg",		max_avg),
+	STAT_ENTRY("percentile",	percentile),
 };
 
 static DEFINE_PER_CPU(struct percpu_data, data) = {
-	.irq		= STATISTICS_INITIALIZER,
-	.preempt	= STATISTICS_INITIALIZER,
-	.irq_save	= STATISTICS_INITIALIZER,
-	.should_run	= true,
+	.stat		= { [0 ... NR_PRIMITIVES - 1] = STATISTICS_INITIALIZER },
 };
 
-static DECLARE_COMPLETION(threads_should_run);
+/*
+ * The sampling threads sleep in smpboot between runs.  A run wakes them,
+ * waits until all of them are at the start barrier (threads_ready),
+ * releases them at once (threads_go) and waits until all of them are done
+ * (threads_done).  A thread whose CPU goes offline is parked by smpboot;
+ * it then leaves the run early, still counting itself out of both
+ * barriers, and does not set its bit in completed_cpus.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(threads_wq);
+static bool threads_go;
+static DECLARE_COMPLETION(threads_ready);
+static DECLARE_COMPLETION(threads_done);
+static atomic_t threads_starting;
+static atomic_t threads_running;
+static struct cpumask completed_cpus;
+/* CPUs online when the run started, whose threads were woken */
+static struct cpumask run_cpus;
+
+/* Number of CPUs in completed_cpus, whose results were aggregated */
+static u64 participating_cpus;
+
+/* Time from waking the sampling threads until all of them are ready, in ns */
+static u64 startup_latency;
 static DEFINE_MUTEX(heap_lock);
-static struct u64_min_heap irq_heap;
-static struct u64_min_heap preempt_heap;
-static struct u64_min_heap irq_save_heap;
+static struct u64_min_heap heaps[NR_PRIMITIVES];
+
+static struct statistics stats[NR_PRIMITIVES] = {
+	[0 ... NR_PRIMITIVES - 1] = STATISTICS_INITIALIZER
+};
+
+/*
+ * Median across CPUs of the per-CPU difference between the median of an
+ * instrumented primitive and the median of its raw counterpart.  Both are
+ * sampled interleaved on the same CPU, so the difference isolates the cost
+ * of the tracing hooks.
+ */
+static u64 instrumentation_delta[NR_INSTRUMENTED];
 
-static struct statistics irq_stat = STATISTICS_INITIALIZER;
-static struct statistics preempt_stat = STATISTICS_INITIALIZER;
-static struct statistics irq_save_stat = STATISTICS_INITIALIZER;
+/* Sum across CPUs of percpu_data::missed */
+static u64 missed[NR_PRIMITIVES];
 
+/* Sum across CPUs of percpu_data::yields */
+static u64 yields;
 
 /*
  * Generate debugfs get/set accessors and file_operations for a size_t
@@ -137,6 +494,12 @@ DEFINE_DEBUGFS_ATTRIBUTE(name##_fops, name##_get, name##_set, "%llu\n")
 
 DEFINE_CONFIG_ATTR(nr_samples);
 DEFINE_CONFIG_ATTR(nr_highest);
+DEFINE_CONFIG_ATTR(canary_samples);
+DEFINE_CONFIG_ATTR(canary_cpus);
+DEFINE_CONFIG_ATTR(canary_threshold);
+DEFINE_CONFIG_ATTR(dl_runtime_us);
+DEFINE_CONFIG_ATTR(dl_period_us);
+DEFINE_CONFIG_ATTR(chunk_us);
 
 static int nth_percentile_get(void *data, u64 *val)
 {
@@ -153,37 +516,155 @@ static int nth_percentile_set(void *data, u64 val)
 DEFINE_DEBUGFS_ATTRIBUTE(nth_percentile_fops, nth_percentile_get,
 			 nth_percentile_set, "%llu\n");
 
-static const struct debugfs_results debugfs_result_files[] = {
-	{
-		"irq",
-		{
-			{"median",	&irq_stat.median	},
-			{"average",	&irq_stat.avg		},
-			{"max",		&irq_stat.max		},
-			{"max_avg",	&irq_stat.max_avg	},
-			{"percentile",	&irq_stat.percentile	},
-		},
-	},
-	{
-		"preempt",
-		{
-			{"median",	&preempt_stat.median	},
-			{"average",	&preempt_stat.avg	},
-			{"max",		&preempt_stat.max	},
-			{"max_avg",	&preempt_stat.max_avg	},
-			{"percentile",	&preempt_stat.percentile},
-		},
-	},
-	{
-		"irq_save",
-		{
-			{"median",	&irq_save_stat.median		},
-			{"average",	&irq_save_stat.avg		},
-			{"max",		&irq_save_stat.max		},
-			{"max_avg",	&irq_save_stat.max_avg		},
-			{"percentile",	&irq_save_stat.percentile	},
-		},
-	},
+#define MAX_REF_PROBES 64
+
+static int nr_ref_probes_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(nr_ref_probes.val);
+	return 0;
+}
+static int nr_ref_probes_set(void *data, u64 val)
+{
+	if (!val || val > MAX_REF_PROBES)
+		return -EINVAL;
+	WRITE_ONCE(nr_ref_probes.val, val);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(nr_ref_probes_fops, nr_ref_probes_get,
+			 nr_ref_probes_set, "%llu\n");
+
+/* Zero disables the lock contention benchmark */
+static int lock_group_size_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(lock_group_size.val);
+	return 0;
+}
+static int lock_group_size_set(void *data, u64 val)
+{
+	if (val > nr_cpu_ids)
+		return -EINVAL;
+	WRITE_ONCE(lock_group_size.val, val);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(lock_group_size_fops, lock_group_size_get,
+			 lock_group_size_set, "%llu\n");
+
+/* SCHED_FIFO priority of the sampling threads */
+static int sched_priority_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(sched_priority.val);
+	return 0;
+}
+static int sched_priority_set(void *data, u64 val)
+{
+	if (!val || val >= MAX_RT_PRIO)
+		return -EINVAL;
+	WRITE_ONCE(sched_priority.val, val);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(sched_priority_fops, sched_priority_get,
+			 sched_priority_set, "%llu\n");
+
+/* Percentage of wall time the sampling threads may spend sampling */
+static int duty_cycle_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(duty_cycle.val);
+	return 0;
+}
+static int duty_cycle_set(void *data, u64 val)
+{
+	if (!val || val > 100)
+		return -EINVAL;
+	WRITE_ONCE(duty_cycle.val, val);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(duty_cycle_fops, duty_cycle_get,
+			 duty_cycle_set, "%llu\n");
+
+/* Whether an optional primitive is sampled in the current run */
+static bool primitive_enabled(enum primitive p)
+{
+	switch (p) {
+	case PRIM_LOCK_ACQUIRE:
+	case PRIM_LOCK_HOLD:
+		return READ_ONCE(lock_group_size.cached);
+	case PRIM_IRQ_PENDING:
+		return READ_ONCE(irq_pending.cached);
+	case PRIM_RESCHED_PENDING:
+		return READ_ONCE(resched_pending.cached);
+	case PRIM_BH_PENDING:
+		return READ_ONCE(bh_pending.cached);
+	case PRIM_HARDIRQ_PREEMPT:
+	case PRIM_HARDIRQ_IRQ_SAVE:
+		return READ_ONCE(hardirq_sampling.cached);
+	case PRIM_SOFTIRQ_IRQ:
+	case PRIM_SOFTIRQ_PREEMPT:
+	case PRIM_SOFTIRQ_IRQ_SAVE:
+		return READ_ONCE(softirq_sampling.cached);
+	default:
+		return true;
+	}
+}
+
+/* Slow path benchmarks report how many samples missed the slow path */
+static bool is_slow_path(enum primitive p)
+{
+	switch (p) {
+	case PRIM_IRQ_PENDING:
+	case PRIM_RESCHED_PENDING:
+	case PRIM_BH_PENDING:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static ssize_t choice_read(struct file *file, char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	const struct choice *c = file->private_data;
+	const size_t cur = READ_ONCE(c->cfg.val);
+	char buf[128];
+	int len = 0;
+
+	for (size_t i = 0; i < c->nr_names; ++i)
+		len += scnprintf(buf + len, sizeof(buf) - len,
+				 i == cur ? "[%s] " : "%s ", c->names[i]);
+
+	/* replace the trailing space */
+	buf[len - 1] = '\n';
+
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static ssize_t choice_write(struct file *file, const char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	struct choice *c = file->private_data;
+	char buf[32];
+	int idx;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	idx = __sysfs_match_string(c->names, c->nr_names, buf);
+	if (idx < 0)
+		return idx;
+
+	WRITE_ONCE(c->cfg.val, idx);
+	return count;
+}
+
+static const struct file_operations choice_fops = {
+	.owner	= THIS_MODULE,
+	.read	= choice_read,
+	.write	= choice_write,
+	.llseek = default_llseek,
+	.open	= simple_open,
 };
 
 static void u64_swp(void *a, void *b, int size)
@@ -260,6 +741,14 @@ static u64 median_and_max(u64 *p, size_t n, u64 *max_val)
 	return (p[pos] + p[pos-1]) / 2;
 }
 
+static void free_heaps(void)
+{
+	for (size_t i = 0; i < NR_PRIMITIVES; ++i) {
+		kvfree(heaps[i].data);
+		heaps[i].data = NULL;
+	}
+}
+
 static int init_heaps(void)
 {
 	/*
@@ -267,19 +756,18 @@ static int init_heaps(void)
 	 * the heap is full
 	 */
 	const size_t n = READ_ONCE(nr_highest.cached) + 1;
-	void *p1 __free(kvfree) = NULL;
-	void *p2 __free(kvfree) = NULL;
-	void *p3 __free(kvfree) = NULL;
-
-	p1 = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
-	p2 = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
-	p3 = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
-	if (!p1 || !p2 || !p3)
-		return -ENOMEM;
 
-	min_heap_init_inline(&irq_heap, no_free_ptr(p1), n);
-	min_heap_init_inline(&preempt_heap, no_free_ptr(p2), n);
-	min_heap_init_inline(&irq_save_heap, no_free_ptr(p3), n);
+	for (size_t i = 0; i < NR_PRIMITIVES; ++i) {
+		u64 *p = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
+
+		if (!p) {
+			free_heaps();
+			return -ENOMEM;
+		}
+
+		min_heap_init_inline(&heaps[i], p, n);
+	}
+
 	return 0;
 }
 
@@ -300,13 +788,58 @@ static void compute_one_stat(struct statistics *stat, u64 *samples, size_t n)
 	stat->percentile = samples[pct_idx];
 }
 
-static void compute_statistics(struct percpu_data *my_data, u64 *irq_data,
-			       u64 *preempt_data, u64 *irq_save_data,
+/*
+ * The samples of all primitives live in a single buffer, one run of
+ * @n samples per enabled primitive.  sample_slot[] packs the enabled
+ * optional primitives after the others, which always come first in
+ * enum order, so the buffer does not grow with the optional benchmarks
+ * that are off.
+ */
+static size_t sample_slot[NR_PRIMITIVES];
+static size_t nr_sample_slots;
+
+/* Called with the configuration of a run snapshotted */
+static void setup_sample_slots(void)
+{
+	size_t slot = 0;
+
+	for (size_t p = 0; p < NR_PRIMITIVES; ++p)
+		if (primitive_enabled(p))
+			sample_slot[p] = slot++;
+
+	WRITE_ONCE(nr_sample_slots, slot);
+}
+
+static inline u64 *primitive_samples(u64 *samples, enum primitive p, size_t n)
+{
+	return samples + sample_slot[p] * n;
+}
+
+static void compute_statistics(struct percpu_data *my_data, u64 *samples,
 			       size_t n)
 {
-	compute_one_stat(&my_data->irq, irq_data, n);
-	compute_one_stat(&my_data->preempt, preempt_data, n);
-	compute_one_stat(&my_data->irq_save, irq_save_data, n);
+	for (size_t p = 0; p < NR_PRIMITIVES; ++p) {
+		if (!primitive_enabled(p)) {
+			my_data->stat[p] = (struct statistics)STATISTICS_INITIALIZER;
+			continue;
+		}
+
+		compute_one_stat(&my_data->stat[p],
+				 primitive_samples(samples, p, n), n);
+		/* sorting a large run takes a while */
+		cond_resched();
+	}
+
+	/*
+	 * Tracing can only add cost, so a negative difference is noise and
+	 * is reported as zero.
+	 */
+	for (size_t p = 0; p < NR_INSTRUMENTED; ++p) {
+		const u64 instr = my_data->stat[p].median;
+		const u64 raw = my_data->stat[raw_primitive(p)].median;
+
+		my_data->delta[p] = instr > raw ? instr - raw : 0;
+	}
 }
 
 /*
@@ -351,52 +884,231 @@ static noinline void simulate_critical_section(void)
 	WRITE_ONCE(*p, val + 1);
 }
 
+/*
+ * Function tracer reference.  Unlike everything else in the module, this
+ * function is meant to be traced: filtering the function or
+ * function_graph tracer to it measures the per-call cost of the fentry
+ * patch site and the tracer callback.  It must be noinline and keep a
+ * side effect so that the call is really emitted.
+ */
+static noinline void tracerbench_traced_fn(void)
+{
+	barrier();
+}
+
+/*
+ * PMU clock source.  A pinned per-CPU cycles event makes perf program and
+ * enable the cycle counter, which the samples then read directly from
+ * PMCCNTR_EL0, ordered with isb() on both sides so that the read is
+ * neither hoisted above nor sunk below the measured code.  The static
+ * key keeps get_cycles() free of any extra branch when it is not used.
+ */
+static DEFINE_STATIC_KEY_FALSE(pmu_clock_key);
+static DEFINE_PER_CPU(struct perf_event *, pmu_cycles);
+static u64 pmu_clock;
+
+static __always_inline u64 read_clock(void)
+{
+#ifdef CONFIG_ARM64
+	if (static_branch_unlikely(&pmu_clock_key)) {
+		u64 val;
+
+		isb();
+		val = read_sysreg(pmccntr_el0);
+		isb();
+		return val;
+	}
+#endif
+	return get_cycles();
+}
+
+static void detach_clock(void)
+{
+	unsigned int cpu;
+
+	static_branch_disable(&pmu_clock_key);
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(pmu_cycles, cpu))
+			perf_event_release_kernel(per_cpu(pmu_cycles, cpu));
+		per_cpu(pmu_cycles, cpu) = NULL;
+	}
+}
+
+#ifdef CONFIG_ARM64
+/*
+ * perf may have counted cycles on a general purpose counter, e.g. if the
+ * cycle counter is taken; make sure PMCCNTR_EL0 is running on each CPU.
+ */
+static void check_pmccntr(void *info)
+{
+	int *ret = info;
+	const u64 start = read_sysreg(pmccntr_el0);
+
+	ndelay(100);
+	if (read_sysreg(pmccntr_el0) == start)
+		*ret = -ENODEV;
+}
+
+/* Called with the CPU hotplug lock held */
+static int open_pmu_cycles(const struct cpumask *cpus)
+{
+	/*
+	 * config1 bit 0 is the arm_pmuv3 "long" format bit.  A 32-bit event
+	 * would have PMCCNTR_EL0 rewritten to -period on every overflow, about
+	 * once a second, and a sample spanning that would go backwards.
+	 */
+	struct perf_event_attr attr = {
+		.type		= PERF_TYPE_HARDWARE,
+		.config		= PERF_COUNT_HW_CPU_CYCLES,
+		.config1	= 1,
+		.size		= sizeof(attr),
+		.pinned		= 1,
+	};
+	unsigned int cpu;
+	int ret = 0;
+
+	for_each_cpu_and(cpu, cpus, cpu_online_mask) {
+		struct perf_event *event;
+
+		event = perf_event_create_kernel_counter(&attr, cpu, NULL,
+							 NULL, NULL);
+		if (IS_ERR(event))
+			return PTR_ERR(event);
+
+		per_cpu(pmu_cycles, cpu) = event;
+	}
+
+	for_each_cpu_and(cpu, cpus, cpu_online_mask) {
+		smp_call_function_single(cpu, check_pmccntr, &ret, 1);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void clock_fallback_warn(int err)
+{
+	pr_warn("PMU cycle counter unavailable (%d), falling back to the generic timer: resolution is one %u Hz tick\n",
+		err, arch_timer_get_cntfrq());
+}
+#else
+static int open_pmu_cycles(const struct cpumask *cpus)
+{
+	return -EOPNOTSUPP;
+}
+
+static void clock_fallback_warn(int err)
+{
+	pr_warn("the PMU clock source is only implemented on arm64, using get_cycles()\n");
+}
+#endif
+
+/*
+ * Flipping the static key takes cpus_read_lock(), so this must be called
+ * before run_benchmark() takes the hotplug lock.  Failing to set up the
+ * PMU counter is not an error: the run falls back to get_cycles().
+ * Returns whether the PMU counter is in use.  Called with benchmark_lock
+ * held, by the sample and canary files as well, which only open the
+ * counter on the @cpus they sample.
+ */
+static bool attach_clock(enum clock_source c, const struct cpumask *cpus)
+{
+	int ret;
+
+	if (c != CLKSRC_PMU)
+		return false;
+
+	cpus_read_lock();
+	ret = open_pmu_cycles(cpus);
+	cpus_read_unlock();
+
+	if (ret) {
+		detach_clock();
+		clock_fallback_warn(ret);
+		return false;
+	}
+
+	static_branch_enable(&pmu_clock_key);
+	return true;
+}
+
 #define OVERHEAD_SAMPLES 100
 
 /*
  * Measure the cost of the timing infrastructure itself.
  *
- * Take the median of OVERHEAD_SAMPLES back-to-back get_cycles() pairs
+ * Take the median of OVERHEAD_SAMPLES back-to-back read_clock() pairs
  * to get a stable estimate of the timer overhead.  The median resists
- * outliers from interrupts and VM exits.  When do_work is enabled,
- * include the cost of simulate_critical_section() in the overhead so
- * that it is subtracted from the final results, isolating only the
- * disable/enable cost.
+ * outliers from interrupts and VM exits.  When @work is set, include the
+ * cost of simulate_critical_section() in the overhead so that it is
+ * subtracted from the final results, isolating only the disable/enable
+ * cost.
  */
-static noinline u64 measure_overhead(void)
+static noinline u64 measure_overhead(bool work)
 {
-	const bool work = READ_ONCE(do_work);
 	u64 samples[OVERHEAD_SAMPLES];
 	size_t i;
 
 	for (i = 0; i < OVERHEAD_SAMPLES; ++i) {
-		const u64 ts = get_cycles();
+		const u64 ts = read_clock();
 
 		if (work)
 			simulate_critical_section();
-		samples[i] = get_cycles() - ts;
+		samples[i] = read_clock() - ts;
 	}
 
 	return median_and_max(samples, OVERHEAD_SAMPLES, NULL);
 }
 
 #define time_diff(call, work) ({	\
-	const u64 ts = get_cycles();	\
+	const u64 ts = read_clock();	\
 	call##_disable();		\
 	if (work)			\
 		simulate_critical_section();\
 	call##_enable();		\
-	get_cycles() - ts;		\
+	read_clock() - ts;		\
 })
 
-#define time_diff_save_restore(work) ({		\
+#define time_diff_notrace(call, work) ({	\
+	const u64 ts = read_clock();		\
+	call##_disable_notrace();		\
+	if (work)				\
+		simulate_critical_section();	\
+	call##_enable_notrace();		\
+	read_clock() - ts;			\
+})
+
+#define time_diff_save_restore(call, work) ({	\
 	unsigned long __flags;			\
-	const u64 ts = get_cycles();		\
-	local_irq_save(__flags);		\
+	const u64 ts = read_clock();		\
+	call##_save(__flags);			\
 	if (work)				\
 		simulate_critical_section();	\
-	local_irq_restore(__flags);		\
-	get_cycles() - ts;			\
+	call##_restore(__flags);		\
+	read_clock() - ts;			\
+})
+
+/*
+ * Fire a reference tracepoint twice per sample, as a disable/enable pair
+ * fires two preemptirq events.
+ */
+#define time_diff_tp(event, work) ({			\
+	const u64 ts = read_clock();			\
+	trace_##event(_THIS_IP_, _RET_IP_);		\
+	if (work)					\
+		simulate_critical_section();		\
+	trace_##event(_THIS_IP_, _RET_IP_);		\
+	read_clock() - ts;				\
+})
+
+#define time_diff_call(fn, work) ({			\
+	const u64 ts = read_clock();			\
+	fn();						\
+	if (work)					\
+		simulate_critical_section();		\
+	read_clock() - ts;				\
 })
 
 static void subtract_overhead(u64 *samples, size_t n, u64 overhead)
@@ -409,171 +1121,1558 @@ static void subtract_overhead(u64 *samples, size_t n, u64 overhead)
 	}
 }
 
-static void collect_data(u64 *irq, u64 *preempt, u64 *irq_save, size_t n)
-{
-	const bool work = READ_ONCE(do_work);
-	u64 overhead;
-	size_t i;
-
-	for (i = 0; i < n; ++i)
-		irq[i] = time_diff(local_irq, work);
-
-	for (i = 0; i < n; ++i)
-		preempt[i] = time_diff(preempt, work);
-
-	for (i = 0; i < n; ++i)
-		irq_save[i] = time_diff_save_restore(work);
+/*
+ * Chunked sampling.  Without a break, a large run keeps a CPU busy for
+ * seconds, triggering soft lockup warnings and starving the other tasks
+ * on it.  The sampling loops call chunk_tick() between two samples,
+ * outside of the timed region; every CHUNK_CHECK calls it looks at the
+ * time, and once a chunk has lasted chunk_us it yields with
+ * cond_resched().  With a duty_cycle below 100%, it instead sleeps long
+ * enough for the chunk to take duty_cycle percent of the wall time,
+ * which also lets SCHED_NORMAL tasks run under an RT sampling thread.
+ * The same check sets @stop once smpboot asks a sampling thread to park,
+ * so that a CPU going offline is not held up until the end of a phase.
+ */
+#define CHUNK_CHECK 64
+
+struct chunk {
+	u64 start;
+	u64 limit_ns;
+	unsigned int duty;
+	unsigned int count;
+	u64 yields;
+	/* context switches of the yields and of the resched_pending phase */
+	unsigned long nvcsw;
+	unsigned long nivcsw;
+	bool stop;
+};
 
-	overhead = measure_overhead();
-	subtract_overhead(irq, n, overhead);
-	subtract_overhead(preempt, n, overhead);
-	subtract_overhead(irq_save, n, overhead);
+static void chunk_init(struct chunk *ck, u64 limit_us, unsigned int duty)
+{
+	*ck = (struct chunk) {
+		.start		= local_clock(),
+		.limit_ns	= limit_us * NSEC_PER_USEC,
+		.duty		= duty,
+	};
 }
 
-static void sample_thread_fn(unsigned int cpu)
+static noinline void chunk_check(struct chunk *ck)
 {
-	u64 *irq __free(kvfree) = NULL;
-	u64 *preempt __free(kvfree) = NULL;
-	u64 *irq_save __free(kvfree) = NULL;
-	struct percpu_data *my_data;
-	const size_t n = READ_ONCE(nr_samples.cached);
-	const size_t nh = READ_ONCE(nr_highest.cached);
+	const u64 busy = local_clock() - ck->start;
+	unsigned long nvcsw, nivcsw;
 
-	pr_debug("sample thread starting\n");
-
-	irq = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
-	preempt = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
-	irq_save = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
-	if (!irq || !preempt || !irq_save) {
-		this_cpu_ptr(&data)->should_run = false;
+	ck->count = 0;
+	/* the sample file also samples in chunks, from a user task */
+	if ((current->flags & PF_KTHREAD) && kthread_should_park()) {
+		ck->stop = true;
 		return;
 	}
 
-	wait_for_completion(&threads_should_run);
-	collect_data(irq, preempt, irq_save, n);
+	if (busy < ck->limit_ns)
+		return;
 
-	my_data = get_cpu_ptr(&data);
-	compute_statistics(my_data, irq, preempt, irq_save, n);
+	nvcsw = current->nvcsw;
+	nivcsw = current->nivcsw;
+	if (ck->duty < 100) {
+		const u64 idle_us = div_u64(busy * (100 - ck->duty),
+					    ck->duty * NSEC_PER_USEC);
 
-	/*
-	 * Avoid we reenter the function before the main task call kthread_stop
+		usleep_range(idle_us, idle_us + idle_us / 8 + 1);
+	} else {
+		cond_resched();
+	}
+
+	++ck->yields;
+	ck->nvcsw += current->nvcsw - nvcsw;
+	ck->nivcsw += current->nivcsw - nivcsw;
+	ck->start = local_clock();
+}
+
+static __always_inline void chunk_tick(struct chunk *ck)
+{
+	if (unlikely(++ck->count >= CHUNK_CHECK))
+		chunk_check(ck);
+}
+
+/*
+ * Lock contention benchmark.  The CPUs of a group share one spinlock,
+ * each in its own cache line.  Groups are formed by taking the online
+ * CPUs in an order that depends on lock_placement and cutting that
+ * order into chunks of lock_group_size CPUs:
+ *
+ *  - linear:  CPU number order
+ *  - package: CPUs of the same package are adjacent, so groups stay
+ *	       within a package where possible
+ *  - spread:  packages are interleaved, so groups span packages
+ */
+struct lock_group {
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+static struct lock_group *lock_groups;
+static DEFINE_PER_CPU(spinlock_t *, group_lock);
+
+struct cpu_slot {
+	u64 key;
+	unsigned int cpu;
+};
+
+static int cpu_slot_cmp(const void *a, const void *b)
+{
+	const struct cpu_slot *x = a, *y = b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+
+	return x->cpu < y->cpu ? -1 : x->cpu > y->cpu;
+}
+
+static void free_lock_groups(void)
+{
+	kfree(lock_groups);
+	lock_groups = NULL;
+}
+
+/* Called with the CPU hotplug lock held */
+static int setup_lock_groups(void)
+{
+	const size_t size = READ_ONCE(lock_group_size.cached);
+	struct cpu_slot *slots __free(kfree) = NULL;
+	size_t nr = 0, nr_groups;
+	unsigned int cpu;
+
+	if (!size)
+		return 0;
+
+	slots = kmalloc_array(num_online_cpus(), sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	for_each_online_cpu(cpu) {
+		const u64 pkg = topology_physical_package_id(cpu);
+		u64 rank = 0;
+
+		/* position of this CPU within its package */
+		for (size_t i = 0; i < nr; ++i)
+			if (topology_physical_package_id(slots[i].cpu) == pkg)
+				++rank;
+
+		switch (READ_ONCE(lock_placement.cfg.cached)) {
+		case PLACEMENT_PACKAGE:
+			slots[nr].key = pkg;
+			break;
+		case PLACEMENT_SPREAD:
+			slots[nr].key = rank << 32 | pkg;
+			break;
+		default:
+			slots[nr].key = 0;
+			break;
+		}
+
+		slots[nr++].cpu = cpu;
+	}
+
+	sort(slots, nr, sizeof(*slots), cpu_slot_cmp, NULL);
+
+	nr_groups = DIV_ROUND_UP(nr, size);
+	lock_groups = kmalloc_array(nr_groups, sizeof(*lock_groups), GFP_KERNEL);
+	if (!lock_groups)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < nr_groups; ++i)
+		spin_lock_init(&lock_groups[i].lock);
+
+	for (size_t i = 0; i < nr; ++i)
+		per_cpu(group_lock, slots[i].cpu) = &lock_groups[i / size].lock;
+
+	return 0;
+}
+
+/*
+ * Acquisition latency runs from before spin_lock_irqsave() until the lock
+ * is held; hold time runs from there until spin_unlock_irqrestore()
+ * returns, so it includes the irq restore and its tracing hooks.
+ */
+static void collect_lock_data(u64 *acquire, u64 *hold, size_t n, bool work,
+			      struct chunk *ck)
+{
+	spinlock_t *lock = this_cpu_read(group_lock);
+
+	for (size_t i = 0; i < n && !ck->stop; ++i, chunk_tick(ck)) {
+		unsigned long flags;
+		const u64 ts = read_clock();
+		u64 locked;
+
+		spin_lock_irqsave(lock, flags);
+		locked = read_clock();
+		if (work)
+			simulate_critical_section();
+		spin_unlock_irqrestore(lock, flags);
+		hold[i] = read_clock() - locked;
+		acquire[i] = locked - ts;
+	}
+
+	subtract_overhead(acquire, n, measure_overhead(false));
+	subtract_overhead(hold, n, measure_overhead(work));
+}
+
+/*
+ * Pending interrupt slow path of local_irq_enable().  An irq_work queued
+ * with interrupts disabled raises a self-IPI that stays pending until
+ * local_irq_enable(), which then delivers it before returning.  The
+ * sample covers local_irq_enable() and the delivery of the interrupt,
+ * including its entry/exit tracing hooks.  Samples in which the
+ * interrupt did not run (e.g. architectures without an irq_work IPI,
+ * where irq_work runs from the tick) are counted as missed.
+ */
+static DEFINE_PER_CPU(u64, irq_pending_hits);
+
+static void irq_pending_fn(struct irq_work *work)
+{
+	this_cpu_inc(irq_pending_hits);
+}
+
+static DEFINE_PER_CPU(struct irq_work, irq_pending_work) =
+	IRQ_WORK_INIT_HARD(irq_pending_fn);
+
+static void collect_irq_pending(u64 *samples, size_t n, bool work,
+				struct chunk *ck)
+{
+	struct irq_work *w = this_cpu_ptr(&irq_pending_work);
+	u64 *nr_missed = &this_cpu_ptr(&data)->missed[PRIM_IRQ_PENDING];
+
+	if (!arch_irq_work_has_interrupt())
+		pr_warn_once("no irq_work interrupt, irq_pending measures the fast path\n");
+
+	*nr_missed = 0;
+	for (size_t i = 0; i < n && !ck->stop; ++i, chunk_tick(ck)) {
+		u64 hits, ts;
+
+		local_irq_disable();
+		if (work)
+			simulate_critical_section();
+		hits = __this_cpu_read(irq_pending_hits);
+		irq_work_queue(w);
+		ts = read_clock();
+		local_irq_enable();
+		samples[i] = read_clock() - ts;
+
+		if (this_cpu_read(irq_pending_hits) == hits)
+			++*nr_missed;
+	}
+
+	irq_work_sync(w);
+	subtract_overhead(samples, n, measure_overhead(false));
+}
+
+/*
+ * Rescheduling slow path of preempt_enable().  Each CPU has a SCHED_FIFO
+ * helper bound to it that does nothing but go back to sleep.  Waking it
+ * with preemption disabled sets need_resched, so preempt_enable() enters
+ * preempt_schedule(), switches to the helper and back.  The sample runs
+ * from before preempt_enable() until the sampling thread resumes, i.e.
+ * two context switches and the sched_switch/preemptirq hooks around
+ * them.  Samples in which the helper did not run, e.g. on kernels
+ * without CONFIG_PREEMPTION, are counted as missed.
+ */
+static DEFINE_PER_CPU(struct task_struct *, resched_helper);
+static DEFINE_PER_CPU(u64, resched_helper_runs);
+
+static int resched_helper_fn(void *arg)
+{
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		schedule();
+		this_cpu_inc(resched_helper_runs);
+	}
+
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static void free_resched_helpers(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct task_struct *task = per_cpu(resched_helper, cpu);
+
+		if (task) {
+			kthread_stop(task);
+			per_cpu(resched_helper, cpu) = NULL;
+		}
+	}
+}
+
+/* Called with the CPU hotplug lock held */
+static int setup_resched_helpers(void)
+{
+	const struct sched_attr attr = {
+		.size		= sizeof(attr),
+		.sched_policy	= SCHED_FIFO,
+		.sched_priority	= MAX_RT_PRIO - 1,
+	};
+	unsigned int cpu;
+
+	if (!primitive_enabled(PRIM_RESCHED_PENDING))
+		return 0;
+
+	for_each_online_cpu(cpu) {
+		struct task_struct *task;
+
+		task = kthread_create_on_cpu(resched_helper_fn, NULL, cpu,
+					     "tracerbench_rs/%u");
+		if (IS_ERR(task))
+			return PTR_ERR(task);
+
+		/* above FIFO sampling threads of any priority */
+		sched_setattr_nocheck(task, &attr);
+		per_cpu(resched_helper, cpu) = task;
+		wake_up_process(task);
+	}
+
+	return 0;
+}
+
+static void collect_resched_pending(u64 *samples, size_t n, bool work,
+				    struct chunk *ck)
+{
+	struct task_struct *helper = this_cpu_read(resched_helper);
+	u64 *nr_missed = &this_cpu_ptr(&data)->missed[PRIM_RESCHED_PENDING];
+
+	*nr_missed = 0;
+	for (size_t i = 0; i < n && !ck->stop; ++i, chunk_tick(ck)) {
+		u64 runs, ts;
+
+		preempt_disable();
+		if (work)
+			simulate_critical_section();
+		runs = __this_cpu_read(resched_helper_runs);
+		wake_up_process(helper);
+		ts = read_clock();
+		preempt_enable();
+		samples[i] = read_clock() - ts;
+
+		if (this_cpu_read(resched_helper_runs) == runs) {
+			++*nr_missed;
+			/* let the helper go back to sleep */
+			cond_resched();
+		}
+	}
+
+	subtract_overhead(samples, n, measure_overhead(false));
+}
+
+/*
+ * Pending softirq slow path of local_bh_enable().  Scheduling a tasklet
+ * with bottom halves disabled raises TASKLET_SOFTIRQ, which
+ * local_bh_enable() then runs inline through do_softirq().  The sample
+ * covers the softirq entry/exit, the tasklet dispatch and the preempt
+ * and irq tracing hooks on the way.  Samples in which the tasklet did
+ * not run, e.g. because softirqs were deferred to ksoftirqd, are counted
+ * as missed.
+ */
+static DEFINE_PER_CPU(struct tasklet_struct, bh_pending_tasklet);
+static DEFINE_PER_CPU(u64, bh_pending_hits);
+
+static void bh_pending_fn(struct tasklet_struct *t)
+{
+	this_cpu_inc(bh_pending_hits);
+}
+
+static void collect_bh_pending(u64 *samples, size_t n, bool work,
+			       struct chunk *ck)
+{
+	struct tasklet_struct *t = this_cpu_ptr(&bh_pending_tasklet);
+	u64 *nr_missed = &this_cpu_ptr(&data)->missed[PRIM_BH_PENDING];
+
+	*nr_missed = 0;
+	for (size_t i = 0; i < n && !ck->stop; ++i, chunk_tick(ck)) {
+		u64 hits, ts;
+
+		local_bh_disable();
+		if (work)
+			simulate_critical_section();
+		hits = __this_cpu_read(bh_pending_hits);
+		tasklet_schedule(t);
+		ts = read_clock();
+		local_bh_enable();
+		samples[i] = read_clock() - ts;
+
+		if (this_cpu_read(bh_pending_hits) == hits)
+			++*nr_missed;
+	}
+
+	/* wait for a deferred run */
+	tasklet_kill(t);
+	subtract_overhead(samples, n, measure_overhead(false));
+}
+
+/*
+ * Sampling from interrupt context.  The samples are taken in blocks of
+ * CONTEXT_BLOCK so that interrupts are not kept disabled for a whole
+ * run.  The sampling thread fills in its CPU's context_block and waits
+ * for the block to be run by a handler on the same CPU.  A NULL array
+ * skips the primitive.
+ */
+#define CONTEXT_BLOCK 64
+
+struct context_block {
+	u64 *irq;
+	u64 *preempt;
+	u64 *irq_save;
+	size_t n;
+	bool work;
+};
+
+static void sample_block(struct context_block *b)
+{
+	size_t i;
+
+	if (b->irq)
+		for (i = 0; i < b->n; ++i)
+			b->irq[i] = time_diff(local_irq, b->work);
+
+	if (b->preempt)
+		for (i = 0; i < b->n; ++i)
+			b->preempt[i] = time_diff(preempt, b->work);
+
+	if (b->irq_save)
+		for (i = 0; i < b->n; ++i)
+			b->irq_save[i] = time_diff_save_restore(local_irq, b->work);
+}
+
+/*
+ * Hardirq context.  The block runs from a hard irq_work queued on the
+ * sampling CPU, i.e. from the irq_work self-IPI handler.  Interrupts are
+ * already disabled and the hardirq bits of preempt_count are set, so the
+ * tracing hooks take their nested branches: local_irq_save() finds
+ * interrupts disabled and preempt_disable() does not hit zero.  The
+ * local_irq_disable/enable pair is not sampled, as enabling interrupts
+ * in the handler would let other interrupts nest into the block.
+ */
+static DEFINE_PER_CPU(struct context_block, hardirq_block);
+
+static void hardirq_block_fn(struct irq_work *work)
+{
+	sample_block(this_cpu_ptr(&hardirq_block));
+}
+
+static DEFINE_PER_CPU(struct irq_work, hardirq_work) =
+	IRQ_WORK_INIT_HARD(hardirq_block_fn);
+
+static void collect_hardirq(u64 *preempt, u64 *irq_save, size_t n, bool work,
+			    struct chunk *ck)
+{
+	struct irq_work *w = this_cpu_ptr(&hardirq_work);
+	struct context_block *b = this_cpu_ptr(&hardirq_block);
+	const u64 overhead = measure_overhead(work);
+
+	if (!arch_irq_work_has_interrupt())
+		pr_warn_once("no irq_work interrupt, hardirq blocks run from the tick\n");
+
+	for (size_t i = 0; i < n && !ck->stop;
+	     i += CONTEXT_BLOCK, chunk_check(ck)) {
+		*b = (struct context_block) {
+			.preempt = preempt + i,
+			.irq_save = irq_save + i,
+			.n = min_t(size_t, n - i, CONTEXT_BLOCK),
+			.work = work,
+		};
+		irq_work_queue(w);
+		irq_work_sync(w);
+	}
+
+	subtract_overhead(preempt, n, overhead);
+	subtract_overhead(irq_save, n, overhead);
+}
+
+/*
+ * Softirq context.  The block runs from a per-CPU tasklet, so
+ * TASKLET_SOFTIRQ is being served and preempt_count has SOFTIRQ_OFFSET
+ * set, as for the networking receive path.  Scheduling it with bottom
+ * halves disabled makes local_bh_enable() run it inline; tasklet_kill()
+ * then only waits in case it was deferred to ksoftirqd.
+ */
+static DEFINE_PER_CPU(struct context_block, softirq_block);
+static DEFINE_PER_CPU(struct tasklet_struct, softirq_tasklet);
+
+static void softirq_block_fn(struct tasklet_struct *t)
+{
+	sample_block(this_cpu_ptr(&softirq_block));
+}
+
+static void collect_softirq(u64 *irq, u64 *preempt, u64 *irq_save, size_t n,
+			    bool work, struct chunk *ck)
+{
+	struct tasklet_struct *t = this_cpu_ptr(&softirq_tasklet);
+	struct context_block *b = this_cpu_ptr(&softirq_block);
+	const u64 overhead = measure_overhead(work);
+
+	for (size_t i = 0; i < n && !ck->stop;
+	     i += CONTEXT_BLOCK, chunk_check(ck)) {
+		*b = (struct context_block) {
+			.irq = irq + i,
+			.preempt = preempt + i,
+			.irq_save = irq_save + i,
+			.n = min_t(size_t, n - i, CONTEXT_BLOCK),
+			.work = work,
+		};
+		local_bh_disable();
+		tasklet_schedule(t);
+		local_bh_enable();
+		tasklet_kill(t);
+	}
+
+	subtract_overhead(irq, n, overhead);
+	subtract_overhead(preempt, n, overhead);
+	subtract_overhead(irq_save, n, overhead);
+}
+
+/*
+ * Each instrumented sample is immediately followed by a sample of its
+ * raw/notrace counterpart, so both distributions see the same cache,
+ * frequency and interrupt conditions on this CPU.
+ */
+static void collect_instrumented(u64 *samples, size_t n, bool work,
+				 struct chunk *ck)
+{
+	u64 *irq = primitive_samples(samples, PRIM_IRQ, n);
+	u64 *preempt = primitive_samples(samples, PRIM_PREEMPT, n);
+	u64 *irq_save = primitive_samples(samples, PRIM_IRQ_SAVE, n);
+	u64 *raw_irq = primitive_samples(samples, PRIM_RAW_IRQ, n);
+	u64 *raw_preempt = primitive_samples(samples, PRIM_RAW_PREEMPT, n);
+	u64 *raw_irq_save = primitive_samples(samples, PRIM_RAW_IRQ_SAVE, n);
+	size_t i;
+
+	for (i = 0; i < n && !ck->stop; ++i, chunk_tick(ck)) {
+		irq[i] = time_diff(local_irq, work);
+		raw_irq[i] = time_diff(raw_local_irq, work);
+	}
+
+	for (i = 0; i < n && !ck->stop; ++i, chunk_tick(ck)) {
+		preempt[i] = time_diff(preempt, work);
+		raw_preempt[i] = time_diff_notrace(preempt, work);
+	}
+
+	for (i = 0; i < n && !ck->stop; ++i, chunk_tick(ck)) {
+		irq_save[i] = time_diff_save_restore(local_irq, work);
+		raw_irq_save[i] = time_diff_save_restore(raw_local_irq, work);
+	}
+}
+
+/*
+ * The lock contention benchmark runs first, right after the start
+ * barrier, so that the CPUs of a group overlap as much as possible.
+ *
+ * Returns false if the CPU started going offline, which smpboot signals
+ * by asking the thread to park.  The sampling loops stop at the next
+ * chunk_check() and the remaining phases are skipped.
+ */
+static bool collect_data(u64 *samples, size_t n, struct chunk *ck)
+{
+	const bool work = READ_ONCE(do_work);
+	u64 *tp_ref0 = primitive_samples(samples, PRIM_TP_REF0, n);
+	u64 *tp_ref1 = primitive_samples(samples, PRIM_TP_REF1, n);
+	u64 *tp_refn = primitive_samples(samples, PRIM_TP_REFN, n);
+	u64 *fentry_ref = primitive_samples(samples, PRIM_FENTRY_REF, n);
+	u64 overhead;
+	size_t i;
+
+	if (primitive_enabled(PRIM_LOCK_ACQUIRE))
+		collect_lock_data(primitive_samples(samples, PRIM_LOCK_ACQUIRE, n),
+				  primitive_samples(samples, PRIM_LOCK_HOLD, n),
+				  n, work, ck);
+
+	if (kthread_should_park())
+		return false;
+
+	collect_instrumented(samples, n, work, ck);
+
+	if (kthread_should_park())
+		return false;
+
+	for (i = 0; i < n && !ck->stop; ++i, chunk_tick(ck)) {
+		tp_ref0[i] = time_diff_tp(tracerbench_ref0, work);
+		tp_ref1[i] = time_diff_tp(tracerbench_ref1, work);
+		tp_refn[i] = time_diff_tp(tracerbench_refn, work);
+	}
+
+	for (i = 0; i < n && !ck->stop; ++i, chunk_tick(ck))
+		fentry_ref[i] = time_diff_call(tracerbench_traced_fn, work);
+
+	/* the optional benchmarks correct their own samples */
+	overhead = measure_overhead(work);
+	for (size_t p = PRIM_IRQ; p <= PRIM_FENTRY_REF; ++p)
+		subtract_overhead(primitive_samples(samples, p, n), n, overhead);
+
+	if (kthread_should_park())
+		return false;
+
+	if (primitive_enabled(PRIM_IRQ_PENDING))
+		collect_irq_pending(primitive_samples(samples, PRIM_IRQ_PENDING, n),
+				    n, work, ck);
+
+	/*
+	 * Every sample of this phase is a preemption, so leave all of its
+	 * context switches, chunk yields included, out of the counts.
+	 */
+	if (primitive_enabled(PRIM_RESCHED_PENDING)) {
+		const unsigned long nvcsw = current->nvcsw - ck->nvcsw;
+		const unsigned long nivcsw = current->nivcsw - ck->nivcsw;
+
+		collect_resched_pending(primitive_samples(samples, PRIM_RESCHED_PENDING, n),
+					n, work, ck);
+		ck->nvcsw = current->nvcsw - nvcsw;
+		ck->nivcsw = current->nivcsw - nivcsw;
+	}
+
+	if (primitive_enabled(PRIM_BH_PENDING))
+		collect_bh_pending(primitive_samples(samples, PRIM_BH_PENDING, n),
+				   n, work, ck);
+
+	if (kthread_should_park())
+		return false;
+
+	if (primitive_enabled(PRIM_HARDIRQ_PREEMPT))
+		collect_hardirq(primitive_samples(samples, PRIM_HARDIRQ_PREEMPT, n),
+				primitive_samples(samples, PRIM_HARDIRQ_IRQ_SAVE, n),
+				n, work, ck);
+
+	if (primitive_enabled(PRIM_SOFTIRQ_IRQ))
+		collect_softirq(primitive_samples(samples, PRIM_SOFTIRQ_IRQ, n),
+				primitive_samples(samples, PRIM_SOFTIRQ_PREEMPT, n),
+				primitive_samples(samples, PRIM_SOFTIRQ_IRQ_SAVE, n),
+				n, work, ck);
+
+	return !kthread_should_park();
+}
+
+#define MIN_SAMPLES 100
+
+/*
+ * Allocate the sample buffer of a run, halving the number of samples
+ * while the allocation fails, down to MIN_SAMPLES.  A CPU short of
+ * memory then still takes part in the run with a smaller budget.
+ */
+static u64 *alloc_samples(size_t *n)
+{
+	const size_t min_n = min_t(size_t, *n, MIN_SAMPLES);
+
+	for (;;) {
+		u64 *samples = kvmalloc_array(*n,
+					      READ_ONCE(nr_sample_slots) * sizeof(u64),
+					      GFP_KERNEL | __GFP_NOWARN);
+
+		if (samples || *n == min_n)
+			return samples;
+
+		*n = max(*n / 2, min_n);
+	}
+}
+
+static void sample_thread_fn(unsigned int cpu)
+{
+	u64 *samples __free(kvfree) = NULL;
+	struct percpu_data *my_data;
+	const size_t nr = READ_ONCE(nr_samples.cached);
+	size_t n = nr, nh;
+	unsigned long nvcsw, nivcsw;
+	struct chunk ck;
+
+	pr_debug("sample thread starting\n");
+
+	samples = alloc_samples(&n);
+	if (!samples) {
+		pr_warn("CPU %u cannot allocate %d samples, leaving the run\n",
+			cpu, MIN_SAMPLES);
+		this_cpu_ptr(&data)->status = PART_NO_MEMORY;
+		WRITE_ONCE(this_cpu_ptr(&data)->should_run, false);
+		if (atomic_dec_and_test(&threads_starting))
+			complete(&threads_ready);
+		if (atomic_dec_and_test(&threads_running))
+			complete(&threads_done);
+		return;
+	}
+
+	if (n < nr)
+		pr_warn("CPU %u short of memory, taking %zu samples instead of %zu\n",
+			cpu, n, nr);
+	nh = min(n, READ_ONCE(nr_highest.cached));
+
+	if (atomic_dec_and_test(&threads_starting))
+		complete(&threads_ready);
+	wait_event(threads_wq, READ_ONCE(threads_go) || kthread_should_park());
+
+	nvcsw = current->nvcsw;
+	nivcsw = current->nivcsw;
+	chunk_init(&ck, READ_ONCE(chunk_us.cached), READ_ONCE(duty_cycle.cached));
+	if (kthread_should_park() || !collect_data(samples, n, &ck)) {
+		pr_info("CPU %u going offline, dropping its results\n", cpu);
+		this_cpu_ptr(&data)->status = PART_OFFLINE;
+		WRITE_ONCE(this_cpu_ptr(&data)->should_run, false);
+		if (atomic_dec_and_test(&threads_running))
+			complete(&threads_done);
+		return;
+	}
+
+	/* the thread is bound to its CPU, no need to disable preemption */
+	my_data = per_cpu_ptr(&data, cpu);
+	my_data->nvcsw = current->nvcsw - nvcsw - ck.nvcsw;
+	my_data->nivcsw = current->nivcsw - nivcsw - ck.nivcsw;
+	my_data->yields = ck.yields;
+	my_data->nr_samples = n;
+	my_data->status = n < nr ? PART_REDUCED : PART_COMPLETED;
+	compute_statistics(my_data, samples, n);
+
+	/* go back to sleep until the next run */
+	WRITE_ONCE(my_data->should_run, false);
+
+	/*
+	 * Feed the top nh samples into the global min-heaps for max_avg
+	 * computation. compute_statistics() sorts the arrays via
+	 * median_and_max(), so the highest values sit at the tail
+	 * and we can select them with a simple pointer offset.
 	 */
-	my_data->should_run = false;
-	put_cpu_ptr(&data);
+	scoped_guard(mutex, &heap_lock) {
+		for (size_t p = 0; p < NR_PRIMITIVES; ++p)
+			if (primitive_enabled(p))
+				add_samples(&heaps[p],
+					    primitive_samples(samples, p, n) + (n - nh), nh);
+	}
+
+	cpumask_set_cpu(cpu, &completed_cpus);
+	if (atomic_dec_and_test(&threads_running))
+		complete(&threads_done);
+}
+
+static int sample_thread_should_run(unsigned int cpu)
+{
+	return READ_ONCE(this_cpu_ptr(&data)->should_run);
+}
+
+/*
+ * Called in the thread when smpboot parks it.  If the run had already
+ * woken it but it never got to sample_thread_fn(), count it out here.
+ */
+static void sample_thread_park(unsigned int cpu)
+{
+	struct percpu_data *my_data = this_cpu_ptr(&data);
+
+	if (!READ_ONCE(my_data->should_run))
+		return;
+
+	my_data->status = PART_OFFLINE;
+	WRITE_ONCE(my_data->should_run, false);
+	if (atomic_dec_and_test(&threads_starting))
+		complete(&threads_ready);
+	if (atomic_dec_and_test(&threads_running))
+		complete(&threads_done);
+}
+
+/*
+ * Called in the thread when its CPU comes back online.  A CPU that went
+ * offline during a run may have missed the reset to SCHED_NORMAL at the
+ * end of it, and CPUs coming online during a run do not take part.
+ */
+static void sample_thread_unpark(unsigned int cpu)
+{
+	const struct sched_attr attr = {
+		.size		= sizeof(attr),
+		.sched_policy	= SCHED_NORMAL,
+	};
+
+	if (current->policy != SCHED_NORMAL)
+		sched_setattr_nocheck(current, &attr);
+}
+
+static DEFINE_PER_CPU(struct task_struct *, ktracer);
+
+static struct smp_hotplug_thread sample_thread = {
+	.store			= &ktracer,
+	.thread_fn		= sample_thread_fn,
+	.thread_should_run	= sample_thread_should_run,
+	.park			= sample_thread_park,
+	.unpark			= sample_thread_unpark,
+	.thread_comm		= "ktracer/%u",
+};
+
+/*
+ * Called with the CPU hotplug lock held.  SCHED_DEADLINE requires the
+ * affinity of a task to span its root domain, so per-CPU deadline
+ * threads are refused with -EPERM unless each CPU is its own root domain
+ * (exclusive cpusets) or admission control is disabled
+ * (sched_rt_runtime_us = -1).
+ *
+ * The threads of @cpus that went offline are parked, and are set as
+ * well.  Resetting to SCHED_NORMAL goes on past a failure so that as
+ * few threads as possible keep an RT or deadline policy.
+ */
+static int set_thread_policy(enum thread_policy policy,
+			     const struct cpumask *cpus)
+{
+	struct sched_attr attr = { .size = sizeof(attr) };
+	unsigned int cpu;
+	int ret, err = 0;
+
+	switch (policy) {
+	case POLICY_FIFO:
+		attr.sched_policy = SCHED_FIFO;
+		attr.sched_priority = READ_ONCE(sched_priority.cached);
+		break;
+	case POLICY_DEADLINE:
+		attr.sched_policy = SCHED_DEADLINE;
+		attr.sched_runtime = READ_ONCE(dl_runtime_us.cached) * NSEC_PER_USEC;
+		attr.sched_period = READ_ONCE(dl_period_us.cached) * NSEC_PER_USEC;
+		attr.sched_deadline = attr.sched_period;
+		break;
+	default:
+		attr.sched_policy = SCHED_NORMAL;
+		break;
+	}
+
+	for_each_cpu(cpu, cpus) {
+		ret = sched_setattr_nocheck(per_cpu(ktracer, cpu), &attr);
+		if (!ret)
+			continue;
+
+		pr_err("cannot set the %s policy on CPU %u: %d\n",
+		       policy_names[policy], cpu, ret);
+		if (policy != POLICY_NORMAL)
+			return ret;
+		err = err ? : ret;
+	}
+
+	return err;
+}
+
+/*
+ * @total is the sum of all samples and @nr_total their number, so that
+ * CPUs that took fewer samples weigh less in the average.
+ */
+static void aggregate_stat(struct statistics *stat, struct u64_min_heap *heap,
+			   u64 *medians, u64 total, u64 nr_total, u64 max_val,
+			   u64 max_percentile, size_t nr_cpus)
+{
+	stat->median		= median_and_max(medians, nr_cpus, NULL);
+	stat->avg		= div64_u64(total, nr_total);
+	stat->max		= max_val;
+	stat->max_avg		= compute_heap_average(heap);
+	stat->percentile	= max_percentile;
+}
+
+/*
+ * The preemptirq events, looked up by name at module load because the
+ * tracepoint symbols are not exported to modules.
+ */
+static const char * const preemptirq_events[] = {
+	"irq_disable",
+	"irq_enable",
+	"preempt_disable",
+	"preempt_enable",
+};
+
+#define NR_PREEMPTIRQ_EVENTS ARRAY_SIZE(preemptirq_events)
+
+static struct tracepoint *preemptirq_tps[NR_PREEMPTIRQ_EVENTS];
+
+static void __init lookup_tracepoint(struct tracepoint *tp, void *priv)
+{
+	for (size_t i = 0; i < NR_PREEMPTIRQ_EVENTS; ++i)
+		if (!strcmp(tp->name, preemptirq_events[i]))
+			preemptirq_tps[i] = tp;
+}
+
+/* Same signature as the preemptirq_template tracepoint probes */
+static notrace void noop_probe(void *data, unsigned long ip,
+			       unsigned long parent_ip)
+{
+}
+
+static void detach_probes(void)
+{
+	for (size_t i = 0; i < NR_PREEMPTIRQ_EVENTS; ++i)
+		tracepoint_probe_unregister(preemptirq_tps[i], noop_probe, NULL);
+
+	tracepoint_synchronize_unregister();
+}
+
+static int attach_probes(void)
+{
+	size_t i;
+	int ret;
+
+	for (i = 0; i < NR_PREEMPTIRQ_EVENTS; ++i) {
+		if (!preemptirq_tps[i]) {
+			pr_err("tracepoint %s not found\n", preemptirq_events[i]);
+			ret = -ENODEV;
+			goto err;
+		}
+
+		ret = tracepoint_probe_register(preemptirq_tps[i], noop_probe, NULL);
+		if (ret)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	while (i--)
+		tracepoint_probe_unregister(preemptirq_tps[i], noop_probe, NULL);
+	tracepoint_synchronize_unregister();
+	return ret;
+}
+
+static int set_ftrace_events(int enable)
+{
+	int ret;
+
+	for (size_t i = 0; i < NR_PREEMPTIRQ_EVENTS; ++i) {
+		ret = trace_set_clr_event("preemptirq", preemptirq_events[i], enable);
+		if (ret) {
+			pr_err("failed to %s event %s: %d\n",
+			       enable ? "enable" : "disable",
+			       preemptirq_events[i], ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static DEFINE_PER_CPU(struct perf_event *, perf_consumers[NR_PREEMPTIRQ_EVENTS]);
+
+static void detach_perf(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct perf_event **events = per_cpu(perf_consumers, cpu);
+
+		for (size_t i = 0; i < NR_PREEMPTIRQ_EVENTS; ++i) {
+			if (events[i])
+				perf_event_release_kernel(events[i]);
+			events[i] = NULL;
+		}
+	}
+}
+
+/*
+ * Open one counting perf event per CPU on each preemptirq tracepoint.
+ * Counting mode still runs the whole perf tracepoint path (record
+ * assembly and event matching) on every hit, without needing a ring
+ * buffer.
+ */
+static int attach_perf(void)
+{
+	struct perf_event_attr attr = {
+		.type		= PERF_TYPE_TRACEPOINT,
+		.size		= sizeof(attr),
+		.pinned		= 1,
+	};
+	unsigned int cpu;
+
+	for (size_t i = 0; i < NR_PREEMPTIRQ_EVENTS; ++i) {
+		struct trace_event_file *file;
+
+		file = trace_get_event_file(NULL, "preemptirq", preemptirq_events[i]);
+		if (IS_ERR(file)) {
+			pr_err("event %s not found\n", preemptirq_events[i]);
+			detach_perf();
+			return PTR_ERR(file);
+		}
+
+		attr.config = file->event_call->event.type;
+		trace_put_event_file(file);
+
+		for_each_online_cpu(cpu) {
+			struct perf_event *event;
+
+			event = perf_event_create_kernel_counter(&attr, cpu, NULL,
+								 NULL, NULL);
+			if (IS_ERR(event)) {
+				pr_err("failed to open perf event %s on CPU %u: %ld\n",
+				       preemptirq_events[i], cpu, PTR_ERR(event));
+				detach_perf();
+				return PTR_ERR(event);
+			}
+
+			per_cpu(perf_consumers, cpu)[i] = event;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Attaching a consumer flips static keys, which takes cpus_read_lock(),
+ * so this must be called before run_benchmark() takes the hotplug lock.
+ */
+static int attach_consumer(enum consumer c)
+{
+	switch (c) {
+	case CONSUMER_PROBE:
+		return attach_probes();
+	case CONSUMER_FTRACE:
+		return set_ftrace_events(1);
+	case CONSUMER_PERF:
+		return attach_perf();
+	default:
+		return 0;
+	}
+}
+
+static void detach_consumer(enum consumer c)
+{
+	switch (c) {
+	case CONSUMER_PROBE:
+		detach_probes();
+		break;
+	case CONSUMER_FTRACE:
+		set_ftrace_events(0);
+		break;
+	case CONSUMER_PERF:
+		detach_perf();
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Empty probe for the reference tracepoints.  tracerbench_refn gets
+ * nr_ref_probes copies of it, told apart by their data pointer.
+ */
+static notrace void ref_probe(void *data, unsigned long ip,
+			      unsigned long parent_ip)
+{
+}
+
+static size_t nr_refn_probes;
+
+static void detach_ref_probes(void)
+{
+	unregister_trace_tracerbench_ref1(ref_probe, NULL);
+
+	for (size_t i = 0; i < nr_refn_probes; ++i)
+		unregister_trace_tracerbench_refn(ref_probe, (void *)i);
+	nr_refn_probes = 0;
+
+	tracepoint_synchronize_unregister();
+}
+
+static int attach_ref_probes(void)
+{
+	const size_t n = READ_ONCE(nr_ref_probes.cached);
+	int ret;
+
+	ret = register_trace_tracerbench_ref1(ref_probe, NULL);
+	if (ret)
+		return ret;
+
+	for (nr_refn_probes = 0; nr_refn_probes < n; ++nr_refn_probes) {
+		ret = register_trace_tracerbench_refn(ref_probe,
+						      (void *)nr_refn_probes);
+		if (ret) {
+			detach_ref_probes();
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Functions hooked by the attach mechanisms.  Failures to attach to a
+ * single function are not fatal and the number of functions actually
+ * hooked is reported in attach_sites.
+ *
+ * Not every mechanism can hook every function: all four are
+ * NOKPROBE_SYMBOL, so kprobe and kretprobe always fail with -ENOENT,
+ * and kernel/trace is built without CC_FLAGS_FTRACE, so fprobe and
+ * ftrace_ops can only hook preempt_count_add() and preempt_count_sub(),
+ * which themselves only exist with DEBUG_PREEMPT or TRACE_PREEMPT_TOGGLE.
+ */
+static const char * const attach_symbols[] = {
+	"trace_hardirqs_off",
+	"trace_hardirqs_on",
+	"preempt_count_add",
+	"preempt_count_sub",
+};
+
+#define NR_ATTACH_SYMBOLS ARRAY_SIZE(attach_symbols)
+
+static bool attached[NR_ATTACH_SYMBOLS];
+static u64 attach_sites;
+
+#ifdef CONFIG_KPROBES
+static struct kprobe attach_kprobes[NR_ATTACH_SYMBOLS];
+
+static int noop_kprobe_handler(struct kprobe *p, struct pt_regs *regs)
+{
+	return 0;
+}
+
+static int attach_kprobe(size_t i)
+{
+	/* a kprobe must be cleared before it can be registered again */
+	attach_kprobes[i] = (struct kprobe) {
+		.symbol_name	= attach_symbols[i],
+		.pre_handler	= noop_kprobe_handler,
+	};
+
+	return register_kprobe(&attach_kprobes[i]);
+}
+
+static void detach_kprobe(size_t i)
+{
+	unregister_kprobe(&attach_kprobes[i]);
+}
+#else
+static int attach_kprobe(size_t i)
+{
+	return -EOPNOTSUPP;
+}
+
+static void detach_kprobe(size_t i)
+{
+}
+#endif
+
+#ifdef CONFIG_KRETPROBES
+static struct kretprobe attach_kretprobes[NR_ATTACH_SYMBOLS];
+
+static int noop_kretprobe_handler(struct kretprobe_instance *ri,
+				  struct pt_regs *regs)
+{
+	return 0;
+}
+
+static int attach_kretprobe(size_t i)
+{
+	attach_kretprobes[i] = (struct kretprobe) {
+		.kp.symbol_name	= attach_symbols[i],
+		.handler	= noop_kretprobe_handler,
+	};
+
+	return register_kretprobe(&attach_kretprobes[i]);
+}
+
+static void detach_kretprobe(size_t i)
+{
+	unregister_kretprobe(&attach_kretprobes[i]);
+}
+#else
+static int attach_kretprobe(size_t i)
+{
+	return -EOPNOTSUPP;
+}
+
+static void detach_kretprobe(size_t i)
+{
+}
+#endif
+
+#ifdef CONFIG_FPROBE
+static struct fprobe attach_fprobes[NR_ATTACH_SYMBOLS];
+
+static int noop_fprobe_handler(struct fprobe *fp, unsigned long entry_ip,
+			       unsigned long ret_ip, struct ftrace_regs *fregs,
+			       void *entry_data)
+{
+	return 0;
+}
+
+static int attach_fprobe(size_t i)
+{
+	attach_fprobes[i] = (struct fprobe) {
+		.entry_handler	= noop_fprobe_handler,
+	};
+
+	return register_fprobe_syms(&attach_fprobes[i],
+				   (const char **)&attach_symbols[i], 1);
+}
+
+static void detach_fprobe(size_t i)
+{
+	unregister_fprobe(&attach_fprobes[i]);
+}
+#else
+static int attach_fprobe(size_t i)
+{
+	return -EOPNOTSUPP;
+}
+
+static void detach_fprobe(size_t i)
+{
+}
+#endif
+
+#ifdef CONFIG_DYNAMIC_FTRACE
+static void noop_ftrace_handler(unsigned long ip, unsigned long parent_ip,
+				struct ftrace_ops *op, struct ftrace_regs *fregs)
+{
+}
+
+/* One ops per function, as independent tools would register them */
+static struct ftrace_ops attach_ftrace_ops[NR_ATTACH_SYMBOLS] = {
+	[0 ... NR_ATTACH_SYMBOLS - 1] = { .func = noop_ftrace_handler },
+};
+
+static int attach_ftrace(size_t i)
+{
+	struct ftrace_ops *ops = &attach_ftrace_ops[i];
+	char buf[KSYM_NAME_LEN];
+	int ret;
+
+	strscpy(buf, attach_symbols[i], sizeof(buf));
+	ret = ftrace_set_filter(ops, (unsigned char *)buf, strlen(buf), 1);
+	if (ret)
+		return ret;
+
+	ret = register_ftrace_function(ops);
+	if (ret)
+		ftrace_free_filter(ops);
+
+	return ret;
+}
+
+static void detach_ftrace(size_t i)
+{
+	unregister_ftrace_function(&attach_ftrace_ops[i]);
+	ftrace_free_filter(&attach_ftrace_ops[i]);
+}
+#else
+static int attach_ftrace(size_t i)
+{
+	return -EOPNOTSUPP;
+}
+
+static void detach_ftrace(size_t i)
+{
+}
+#endif
+
+static const struct {
+	int (*attach)(size_t i);
+	void (*detach)(size_t i);
+} attach_ops[NR_ATTACH] = {
+	[ATTACH_KPROBE]		= { attach_kprobe,	detach_kprobe		},
+	[ATTACH_KRETPROBE]	= { attach_kretprobe,	detach_kretprobe	},
+	[ATTACH_FPROBE]		= { attach_fprobe,	detach_fprobe		},
+	[ATTACH_FTRACE_OPS]	= { attach_ftrace,	detach_ftrace		},
+};
+
+static void detach_hooks(enum attach a)
+{
+	for (size_t i = 0; i < NR_ATTACH_SYMBOLS; ++i) {
+		if (attached[i])
+			attach_ops[a].detach(i);
+		attached[i] = false;
+	}
+}
+
+/*
+ * Like attach_consumer(), this may take cpus_read_lock() (text patching)
+ * and must be called before run_benchmark().
+ */
+static int attach_hooks(enum attach a)
+{
+	attach_sites = 0;
+
+	if (a == ATTACH_NONE)
+		return 0;
+
+	for (size_t i = 0; i < NR_ATTACH_SYMBOLS; ++i) {
+		const int ret = attach_ops[a].attach(i);
+
+		if (ret) {
+			pr_warn("cannot attach %s to %s: %d\n",
+				attach_names[a], attach_symbols[i], ret);
+			continue;
+		}
+
+		attached[i] = true;
+		++attach_sites;
+	}
 
-	/*
-	 * Feed the top nh samples into the global min-heaps for max_avg
-	 * computation. compute_statistics() sorts the arrays via
-	 * median_and_max(), so the highest values sit at the tail
-	 * and we can select them with a simple pointer offset.
-	 */
-	guard(mutex)(&heap_lock);
-	add_samples(&irq_heap, irq + (n - nh), nh);
-	add_samples(&preempt_heap, preempt + (n - nh), nh);
-	add_samples(&irq_save_heap, irq_save + (n - nh), nh);
+	return attach_sites ? 0 : -ENOENT;
 }
 
-static int sample_thread_should_run(unsigned int cpu)
+/*
+ * Tracepoint verification.
+ *
+ * After sampling, check that the preemptirq tracepoints were in the
+ * state the run was meant to measure: a kernel without the tracepoints
+ * (or with some of them disabled) would otherwise silently report zero
+ * overhead.  The hits are counted in a separate pass rather than during
+ * sampling, because an extra probe would both add to the measured cost
+ * and turn a single-probe tracepoint into an iterated probe list.  The
+ * counting probe is only attached to tracepoints that are already
+ * enabled, so the pass runs under the same tracing state as sampling.
+ */
+#define VERIFY_SAMPLES 1000
+
+struct verify_data {
+	struct task_struct *task;
+	unsigned int primitive;
+	u64 hits[NR_INSTRUMENTED];
+};
+
+static DEFINE_PER_CPU(struct verify_data, verify_data);
+
+static u64 traced;
+static u64 trace_mismatch;
+static u64 tp_expected[NR_INSTRUMENTED];
+static u64 tp_observed[NR_INSTRUMENTED];
+
+static notrace void count_probe(void *data, unsigned long ip,
+				unsigned long parent_ip)
 {
-	return this_cpu_ptr(&data)->should_run;
+	if (this_cpu_read(verify_data.task) == current)
+		this_cpu_inc(verify_data.hits[this_cpu_read(verify_data.primitive)]);
 }
 
-static void sample_thread_cleanup(unsigned int cpu, bool online)
+/* Runs in a kworker bound to @arg */
+static long verify_on_cpu(void *arg)
 {
-	this_cpu_ptr(&data)->should_run = true;
-}
+	struct verify_data *v = per_cpu_ptr(&verify_data, (unsigned long)arg);
+	unsigned long flags;
+	size_t i;
 
-static DEFINE_PER_CPU(struct task_struct *, ktracer);
+	memset(v->hits, 0, sizeof(v->hits));
+	WRITE_ONCE(v->primitive, PRIM_IRQ);
+	WRITE_ONCE(v->task, current);
 
-static struct smp_hotplug_thread sample_thread = {
-	.store			= &ktracer,
-	.thread_fn		= sample_thread_fn,
-	.thread_should_run	= sample_thread_should_run,
-	.cleanup		= sample_thread_cleanup,
-	.thread_comm		= "ktracer/%u",
-};
+	for (i = 0; i < VERIFY_SAMPLES; ++i) {
+		local_irq_disable();
+		local_irq_enable();
+	}
 
-static void aggregate_stat(struct statistics *stat, struct u64_min_heap *heap,
-			   u64 *medians, u64 total, u64 max_val,
-			   u64 max_percentile, size_t nr_cpus)
+	WRITE_ONCE(v->primitive, PRIM_PREEMPT);
+	for (i = 0; i < VERIFY_SAMPLES; ++i) {
+		preempt_disable();
+		preempt_enable();
+	}
+
+	WRITE_ONCE(v->primitive, PRIM_IRQ_SAVE);
+	for (i = 0; i < VERIFY_SAMPLES; ++i) {
+		local_irq_save(flags);
+		local_irq_restore(flags);
+	}
+
+	WRITE_ONCE(v->task, NULL);
+	return 0;
+}
+
+static int verify_tracepoints(void)
 {
-	stat->median		= median_and_max(medians, nr_cpus, NULL);
-	stat->avg		= total / nr_cpus;
-	stat->max		= max_val;
-	stat->max_avg		= compute_heap_average(heap);
-	stat->percentile	= max_percentile;
+	/* Any consumer attached by the module implies a traced run */
+	const bool want = READ_ONCE(expect_traced) ||
+			  consumer.cfg.cached != CONSUMER_NONE;
+	/*
+	 * The irqsoff and preemptoff tracers are called directly from the
+	 * tracing functions on current kernels but registered on some of
+	 * the events on older ones, so with a latency tracer as consumer
+	 * the hits are only reported, not checked.
+	 */
+	const bool latency = READ_ONCE(latency_tracer);
+	bool enabled[NR_PREEMPTIRQ_EVENTS];
+	size_t nr_enabled = 0;
+	unsigned int cpu;
+	int ret;
+
+	memset(tp_expected, 0, sizeof(tp_expected));
+	memset(tp_observed, 0, sizeof(tp_observed));
+
+	for (size_t i = 0; i < NR_PREEMPTIRQ_EVENTS; ++i) {
+		enabled[i] = preemptirq_tps[i] &&
+			     static_key_enabled(&preemptirq_tps[i]->key);
+		if (!enabled[i])
+			continue;
+
+		ret = tracepoint_probe_register(preemptirq_tps[i], count_probe, NULL);
+		if (ret) {
+			while (i--)
+				if (enabled[i])
+					tracepoint_probe_unregister(preemptirq_tps[i],
+								    count_probe, NULL);
+			tracepoint_synchronize_unregister();
+			return ret;
+		}
+		++nr_enabled;
+	}
+
+	traced = nr_enabled == NR_PREEMPTIRQ_EVENTS;
+
+	scoped_guard(cpus_read_lock) {
+		for_each_online_cpu(cpu) {
+			const struct verify_data *v = per_cpu_ptr(&verify_data, cpu);
+
+			/* each sample fires a disable and an enable event */
+			if (want && !latency)
+				for (size_t p = 0; p < NR_INSTRUMENTED; ++p)
+					tp_expected[p] += 2 * VERIFY_SAMPLES;
+
+			if (!nr_enabled)
+				continue;
+
+			work_on_cpu(cpu, verify_on_cpu, (void *)(unsigned long)cpu);
+			for (size_t p = 0; p < NR_INSTRUMENTED; ++p)
+				tp_observed[p] += v->hits[p];
+		}
+	}
+
+	for (size_t i = 0; i < NR_PREEMPTIRQ_EVENTS; ++i)
+		if (enabled[i])
+			tracepoint_probe_unregister(preemptirq_tps[i], count_probe, NULL);
+	tracepoint_synchronize_unregister();
+
+	/*
+	 * Interrupts may add a few hits of their own, so a traced run only
+	 * needs at least the expected count.
+	 */
+	trace_mismatch = !latency && want != traced;
+	if (trace_mismatch)
+		pr_warn("preemptirq tracepoints %s enabled, expected %s\n",
+			traced ? "are" : "are not (all)",
+			want ? "enabled" : "disabled");
+
+	for (size_t p = 0; p < NR_INSTRUMENTED; ++p) {
+		if (latency ||
+		    (want ? tp_observed[p] >= tp_expected[p] : !tp_observed[p]))
+			continue;
+
+		pr_warn("%s: %llu tracepoint hits, expected %llu\n",
+			primitive_names[p], tp_observed[p], tp_expected[p]);
+		trace_mismatch = true;
+	}
+
+	return 0;
 }
 
 static int run_benchmark(void)
 {
-	u64 *irq_medians __free(kfree) = NULL;
-	u64 *preempt_medians __free(kfree) = NULL;
-	u64 *irq_save_medians __free(kfree) = NULL;
+	u64 *medians __free(kfree) = NULL;
+	u64 *deltas __free(kfree) = NULL;
 	size_t i, nr_cpus;
 	int ret = 0;
 	unsigned int cpu;
-	u64 irq_total = 0, preempt_total = 0, irq_save_total = 0;
-	u64 irq_max = 0, preempt_max = 0, irq_save_max = 0;
-	u64 irq_pct = 0, preempt_pct = 0, irq_save_pct = 0;
+	u64 total[NR_PRIMITIVES] = {};
+	u64 max_val[NR_PRIMITIVES] = {};
+	u64 pct[NR_PRIMITIVES] = {};
+	u64 nr_total = 0;
+	ktime_t start;
+
+	memset(missed, 0, sizeof(missed));
+	yields = 0;
+	participating_cpus = 0;
+	cpumask_clear(&completed_cpus);
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(&data, cpu)->status = PART_IDLE;
 
+	/*
+	 * Only hold the hotplug lock while taking the snapshot of the
+	 * participating CPUs.  A CPU going offline later parks its thread,
+	 * which then drops its results (see sample_thread_fn()).
+	 */
 	scoped_guard(cpus_read_lock) {
-		ret = smpboot_register_percpu_thread(&sample_thread);
-		if (ret)
+		cpumask_copy(&run_cpus, cpu_online_mask);
+
+		ret = setup_lock_groups();
+		if (!ret)
+			ret = setup_resched_helpers();
+		if (!ret)
+			ret = set_thread_policy(sched_policy.cfg.cached, &run_cpus);
+		if (ret) {
+			set_thread_policy(POLICY_NORMAL, &run_cpus);
+			free_resched_helpers();
+			free_lock_groups();
 			return ret;
+		}
 
-		/*
-		 * we use the completion here to signal the percpu threads to make
-		 * sure they start the same time
-		 */
-		complete_all(&threads_should_run);
+		nr_cpus = cpumask_weight(&run_cpus);
+		atomic_set(&threads_starting, nr_cpus);
+		atomic_set(&threads_running, nr_cpus);
 
-		smpboot_unregister_percpu_thread(&sample_thread);
+		start = ktime_get();
+		for_each_cpu(cpu, &run_cpus) {
+			WRITE_ONCE(per_cpu_ptr(&data, cpu)->should_run, true);
+			wake_up_process(per_cpu(ktracer, cpu));
+		}
+	}
 
-		reinit_completion(&threads_should_run);
+	wait_for_completion(&threads_ready);
+	startup_latency = ktime_to_ns(ktime_sub(ktime_get(), start));
 
-		nr_cpus = num_online_cpus();
+	/* release the threads at once, so that they sample at the same time */
+	WRITE_ONCE(threads_go, true);
+	wake_up_all(&threads_wq);
+	wait_for_completion(&threads_done);
+	WRITE_ONCE(threads_go, false);
 
-		irq_medians = kmalloc_array(nr_cpus, sizeof(u64), GFP_KERNEL);
-		preempt_medians = kmalloc_array(nr_cpus, sizeof(u64), GFP_KERNEL);
-		irq_save_medians = kmalloc_array(nr_cpus, sizeof(u64), GFP_KERNEL);
-		if (!irq_medians || !preempt_medians || !irq_save_medians)
-			return -ENOMEM;
+	/*
+	 * Do not leave idle RT threads behind, including on the CPUs that
+	 * went offline during the run.
+	 */
+	scoped_guard(cpus_read_lock)
+		set_thread_policy(POLICY_NORMAL, &run_cpus);
 
-		i = 0;
-		for_each_online_cpu(cpu) {
-			const struct percpu_data *my_data = per_cpu_ptr(&data, cpu);
+	free_resched_helpers();
+	free_lock_groups();
+
+	nr_cpus = cpumask_weight(&completed_cpus);
+	participating_cpus = nr_cpus;
+	if (!nr_cpus)
+		return -EAGAIN;
+
+	/* medians[p * nr_cpus + i] is the median of primitive p on the ith CPU */
+	medians = kmalloc_array(nr_cpus, NR_PRIMITIVES * sizeof(u64), GFP_KERNEL);
+	deltas = kmalloc_array(nr_cpus, NR_INSTRUMENTED * sizeof(u64), GFP_KERNEL);
+	if (!medians || !deltas)
+		return -ENOMEM;
+
+	i = 0;
+	for_each_cpu(cpu, &completed_cpus) {
+		const struct percpu_data *my_data = per_cpu_ptr(&data, cpu);
+
+		for (size_t p = 0; p < NR_PRIMITIVES; ++p) {
+			const struct statistics *s = &my_data->stat[p];
+			u64 sum;
 
 			/*
-			 * compute the average of the averages. Since the number of samples
-			 * is equal for all average, the math works
+			 * CPUs short of memory may have taken fewer samples, so
+			 * weigh each average by its number of samples
 			 */
-			WARN_ON(check_add_overflow(irq_total, my_data->irq.avg, &irq_total));
-			WARN_ON(check_add_overflow(preempt_total, my_data->preempt.avg,
-						   &preempt_total));
-			WARN_ON(check_add_overflow(irq_save_total, my_data->irq_save.avg,
-						   &irq_save_total));
-
-			irq_max			= max(irq_max, my_data->irq.max);
-			irq_pct			= max(irq_pct, my_data->irq.percentile);
-			irq_medians[i]		= my_data->irq.median;
-
-			preempt_max		= max(preempt_max, my_data->preempt.max);
-			preempt_pct		= max(preempt_pct, my_data->preempt.percentile);
-			preempt_medians[i]	= my_data->preempt.median;
-
-			irq_save_max		= max(irq_save_max, my_data->irq_save.max);
-			irq_save_pct		= max(irq_save_pct, my_data->irq_save.percentile);
-			irq_save_medians[i]	= my_data->irq_save.median;
-			++i;
+			WARN_ON(check_mul_overflow(s->avg, (u64)my_data->nr_samples, &sum));
+			WARN_ON(check_add_overflow(total[p], sum, &total[p]));
+
+			max_val[p]			= max(max_val[p], s->max);
+			pct[p]				= max(pct[p], s->percentile);
+			medians[p * nr_cpus + i]	= s->median;
 		}
+
+		for (size_t p = 0; p < NR_INSTRUMENTED; ++p)
+			deltas[p * nr_cpus + i] = my_data->delta[p];
+
+		for (size_t p = 0; p < NR_PRIMITIVES; ++p)
+			if (is_slow_path(p) && primitive_enabled(p))
+				missed[p] += my_data->missed[p];
+
+		yields += my_data->yields;
+		nr_total += my_data->nr_samples;
+		++i;
 	}
 
-	aggregate_stat(&irq_stat, &irq_heap, irq_medians,
-		       irq_total, irq_max, irq_pct, nr_cpus);
-	aggregate_stat(&preempt_stat, &preempt_heap, preempt_medians,
-		       preempt_total, preempt_max, preempt_pct, nr_cpus);
-	aggregate_stat(&irq_save_stat, &irq_save_heap, irq_save_medians,
-		       irq_save_total, irq_save_max, irq_save_pct, nr_cpus);
+	for (size_t p = 0; p < NR_PRIMITIVES; ++p)
+		aggregate_stat(&stats[p], &heaps[p], medians + p * nr_cpus,
+			       total[p], nr_total, max_val[p], pct[p], nr_cpus);
+
+	for (size_t p = 0; p < NR_INSTRUMENTED; ++p)
+		instrumentation_delta[p] = median_and_max(deltas + p * nr_cpus,
+							  nr_cpus, NULL);
 
 	return 0;
 }
@@ -596,15 +2695,54 @@ static ssize_t benchmark_write(struct file *file, const char __user *buffer,
 	WRITE_ONCE(nr_samples.cached, n);
 	WRITE_ONCE(nr_highest.cached, min(n, READ_ONCE(nr_highest.val)));
 	WRITE_ONCE(nth_percentile.cached, READ_ONCE(nth_percentile.val));
+	WRITE_ONCE(consumer.cfg.cached, READ_ONCE(consumer.cfg.val));
+	WRITE_ONCE(attach.cfg.cached, READ_ONCE(attach.cfg.val));
+	WRITE_ONCE(nr_ref_probes.cached, READ_ONCE(nr_ref_probes.val));
+	WRITE_ONCE(lock_group_size.cached, READ_ONCE(lock_group_size.val));
+	WRITE_ONCE(lock_placement.cfg.cached, READ_ONCE(lock_placement.cfg.val));
+	WRITE_ONCE(clock_source.cfg.cached, READ_ONCE(clock_source.cfg.val));
+	WRITE_ONCE(sched_policy.cfg.cached, READ_ONCE(sched_policy.cfg.val));
+	WRITE_ONCE(sched_priority.cached, READ_ONCE(sched_priority.val));
+	WRITE_ONCE(dl_runtime_us.cached, READ_ONCE(dl_runtime_us.val));
+	WRITE_ONCE(dl_period_us.cached, READ_ONCE(dl_period_us.val));
+	WRITE_ONCE(chunk_us.cached, READ_ONCE(chunk_us.val));
+	WRITE_ONCE(duty_cycle.cached, READ_ONCE(duty_cycle.val));
+	WRITE_ONCE(irq_pending.cached, READ_ONCE(irq_pending.val));
+	WRITE_ONCE(resched_pending.cached, READ_ONCE(resched_pending.val));
+	WRITE_ONCE(bh_pending.cached, READ_ONCE(bh_pending.val));
+	WRITE_ONCE(hardirq_sampling.cached, READ_ONCE(hardirq_sampling.val));
+	WRITE_ONCE(softirq_sampling.cached, READ_ONCE(softirq_sampling.val));
+	setup_sample_slots();
 
 	ret = init_heaps();
 	if (ret)
 		return ret;
 
+	pmu_clock = attach_clock(clock_source.cfg.cached, cpu_online_mask);
+
+	ret = attach_ref_probes();
+	if (ret)
+		goto out;
+
+	ret = attach_consumer(consumer.cfg.cached);
+	if (ret)
+		goto out_ref_probes;
+
+	ret = attach_hooks(attach.cfg.cached);
+	if (ret)
+		goto out_consumer;
+
 	ret = run_benchmark();
-	kvfree(irq_heap.data);
-	kvfree(preempt_heap.data);
-	kvfree(irq_save_heap.data);
+	if (!ret)
+		ret = verify_tracepoints();
+	detach_hooks(attach.cfg.cached);
+out_consumer:
+	detach_consumer(consumer.cfg.cached);
+out_ref_probes:
+	detach_ref_probes();
+out:
+	detach_clock();
+	free_heaps();
 
 	return ret ? : count;
 }
@@ -616,6 +2754,309 @@ static const struct file_operations benchmark_fops = {
 	.open	= simple_open,
 };
 
+/*
+ * Sampling from the context of a user task.  Writing to the "sample"
+ * file runs nr_samples of the instrumented primitives and their raw
+ * counterparts on the writer's current CPU, from the syscall, so that
+ * load generators can measure them with their own mm, seccomp filters
+ * and cgroups in place.  Reading the same open file then returns the
+ * log2 histogram of each primitive from the last write: bucket b counts
+ * the samples in [2^(b-1), 2^b - 1], bucket 0 the zero samples.  Opening
+ * the file does not sample anything.
+ */
+#define HIST_BUCKETS	65
+#define NR_HIST_PRIMITIVES	(2 * NR_INSTRUMENTED)
+
+struct histogram {
+	unsigned int cpu;
+	size_t n;
+	u64 count[NR_HIST_PRIMITIVES][HIST_BUCKETS];
+};
+
+static int sample_show(struct seq_file *m, void *v)
+{
+	const struct histogram *hist = m->private;
+
+	/* nothing written yet */
+	if (!hist->n)
+		return 0;
+
+	seq_printf(m, "# cpu: %u, samples: %zu, unit: cycles\n",
+		   hist->cpu, hist->n);
+	seq_puts(m, "# primitive from to count\n");
+
+	for (size_t p = 0; p < NR_HIST_PRIMITIVES; ++p) {
+		for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+			const u64 from = b ? 1ULL << (b - 1) : 0;
+			const u64 to = b ? (from << 1) - 1 : 0;
+
+			if (hist->count[p][b])
+				seq_printf(m, "%s %llu %llu %llu\n", primitive_names[p],
+					   from, to, hist->count[p][b]);
+		}
+	}
+
+	return 0;
+}
+
+static int sample_open(struct inode *inode, struct file *file)
+{
+	struct histogram *hist __free(kfree) = kzalloc(sizeof(*hist), GFP_KERNEL);
+	int ret;
+
+	if (!hist)
+		return -ENOMEM;
+
+	ret = single_open(file, sample_show, hist);
+	if (!ret)
+		hist = NULL;
+
+	return ret;
+}
+
+static ssize_t sample_write(struct file *file, const char __user *buffer,
+			    size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct histogram *hist = m->private;
+	u64 *samples __free(kvfree) = NULL;
+	const size_t n = READ_ONCE(nr_samples.val);
+	unsigned int cpu;
+
+	if (!n)
+		return -EINVAL;
+
+	samples = kvmalloc_array(n, NR_HIST_PRIMITIVES * sizeof(u64), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	/* stay out of the way of a concurrent benchmark run */
+	scoped_guard(mutex, &benchmark_lock) {
+		const bool work = READ_ONCE(do_work);
+		struct chunk ck;
+		u64 overhead;
+
+		/*
+		 * The counter is only opened on this CPU, and attach_clock()
+		 * sleeps, so start over if the task migrated meanwhile.
+		 */
+		for (;;) {
+			cpu = raw_smp_processor_id();
+			attach_clock(READ_ONCE(clock_source.cfg.val), cpumask_of(cpu));
+			migrate_disable();
+			if (smp_processor_id() == cpu)
+				break;
+			migrate_enable();
+			detach_clock();
+		}
+
+		chunk_init(&ck, READ_ONCE(chunk_us.val), READ_ONCE(duty_cycle.val));
+		collect_instrumented(samples, n, work, &ck);
+		overhead = measure_overhead(work);
+		migrate_enable();
+		detach_clock();
+
+		for (size_t p = 0; p < NR_HIST_PRIMITIVES; ++p)
+			subtract_overhead(primitive_samples(samples, p, n), n,
+					  overhead);
+	}
+
+	/* a concurrent read of the same file shows the histogram */
+	guard(mutex)(&m->lock);
+	memset(hist, 0, sizeof(*hist));
+	hist->cpu = cpu;
+	hist->n = n;
+	for (size_t p = 0; p < NR_HIST_PRIMITIVES; ++p) {
+		const u64 *s = primitive_samples(samples, p, n);
+
+		for (size_t i = 0; i < n; ++i)
+			++hist->count[p][fls64(s[i])];
+	}
+
+	return count;
+}
+
+static int hist_release(struct inode *inode, struct file *file)
+{
+	kfree(((struct seq_file *)file->private_data)->private);
+	return single_release(inode, file);
+}
+
+static const struct file_operations sample_fops = {
+	.owner		= THIS_MODULE,
+	.open		= sample_open,
+	.read		= seq_read,
+	.write		= sample_write,
+	.llseek		= seq_lseek,
+	.release	= hist_release,
+};
+
+/*
+ * Canary mode, for periodic checks on production hosts.  Opening the
+ * "canary" file runs canary_samples of each instrumented primitive and
+ * its raw counterpart on the next canary_cpus online CPUs, continuing
+ * where the previous check stopped, from a kworker bound to each CPU in
+ * turn.  Samples go straight into one log2 histogram, so nothing scales
+ * with the sample count and no CPU is taken over for more than the
+ * sampling itself.  Reading returns a single line:
+ *
+ *	PASS|FAIL cpus <list> irq <delta> preempt <delta> irq_save <delta>
+ *
+ * where each delta is the difference between the histogram medians
+ * (interpolated within their bucket) of the primitive and its raw
+ * counterpart, and the check fails if any of them exceeds
+ * canary_threshold cycles.  Like the sample file, the canary is timed
+ * with the clock_source counter.
+ */
+struct canary {
+	struct histogram hist;
+	struct cpumask cpus;
+	u64 delta[NR_INSTRUMENTED];
+	bool pass;
+};
+
+static int canary_last_cpu = -1;
+
+static void hist_add(struct histogram *hist, enum primitive p, u64 val,
+		     u64 overhead)
+{
+	++hist->count[p][fls64(val > overhead ? val - overhead : 0)];
+}
+
+/*
+ * The median is interpolated linearly within its bucket, assuming the
+ * samples are spread evenly over it: bucket lower bounds alone could
+ * only tell medians apart by powers of two.
+ */
+static u64 hist_median(const u64 *count, size_t n)
+{
+	size_t sum = 0;
+
+	for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+		u64 from;
+
+		if (sum + count[b] <= n / 2) {
+			sum += count[b];
+			continue;
+		}
+
+		if (!b)
+			return 0;
+
+		/* bucket b holds [from, 2 * from - 1] */
+		from = 1ULL << (b - 1);
+		return from + mul_u64_u64_div_u64(n / 2 - sum, from, count[b]);
+	}
+
+	return 0;
+}
+
+static long canary_on_cpu(void *arg)
+{
+	struct histogram *hist = arg;
+	const bool work = READ_ONCE(do_work);
+	const u64 overhead = measure_overhead(work);
+
+	for (size_t i = 0; i < hist->n; ++i) {
+		hist_add(hist, PRIM_IRQ, time_diff(local_irq, work), overhead);
+		hist_add(hist, PRIM_RAW_IRQ, time_diff(raw_local_irq, work), overhead);
+	}
+
+	for (size_t i = 0; i < hist->n; ++i) {
+		hist_add(hist, PRIM_PREEMPT, time_diff(preempt, work), overhead);
+		hist_add(hist, PRIM_RAW_PREEMPT, time_diff_notrace(preempt, work),
+			 overhead);
+	}
+
+	for (size_t i = 0; i < hist->n; ++i) {
+		hist_add(hist, PRIM_IRQ_SAVE,
+			 time_diff_save_restore(local_irq, work), overhead);
+		hist_add(hist, PRIM_RAW_IRQ_SAVE,
+			 time_diff_save_restore(raw_local_irq, work), overhead);
+	}
+
+	return 0;
+}
+
+static int canary_show(struct seq_file *m, void *v)
+{
+	const struct canary *c = m->private;
+
+	seq_printf(m, "%s cpus %*pbl", c->pass ? "PASS" : "FAIL",
+		   cpumask_pr_args(&c->cpus));
+	for (size_t p = 0; p < NR_INSTRUMENTED; ++p)
+		seq_printf(m, " %s %llu", primitive_names[p], c->delta[p]);
+	seq_putc(m, '\n');
+
+	return 0;
+}
+
+static int canary_open(struct inode *inode, struct file *file)
+{
+	struct canary *c __free(kfree) = kzalloc(sizeof(*c), GFP_KERNEL);
+	const u64 threshold = READ_ONCE(canary_threshold.val);
+	size_t nr_cpus, total;
+	int ret;
+
+	if (!c)
+		return -ENOMEM;
+
+	c->hist.n = READ_ONCE(canary_samples.val);
+
+	scoped_guard(mutex, &benchmark_lock) {
+		int cpu = canary_last_cpu;
+
+		scoped_guard(cpus_read_lock) {
+			nr_cpus = min_t(size_t, READ_ONCE(canary_cpus.val),
+					num_online_cpus());
+			for (size_t i = 0; i < nr_cpus; ++i) {
+				cpu = cpumask_next(cpu, cpu_online_mask);
+				if (cpu >= nr_cpu_ids)
+					cpu = cpumask_first(cpu_online_mask);
+
+				__cpumask_set_cpu(cpu, &c->cpus);
+			}
+		}
+		canary_last_cpu = cpu;
+
+		/* the counter is only opened on the CPUs that are sampled */
+		attach_clock(READ_ONCE(clock_source.cfg.val), &c->cpus);
+		scoped_guard(cpus_read_lock) {
+			/* leave out the CPUs that went offline meanwhile */
+			cpumask_and(&c->cpus, &c->cpus, cpu_online_mask);
+			for_each_cpu(cpu, &c->cpus)
+				work_on_cpu(cpu, canary_on_cpu, &c->hist);
+		}
+		detach_clock();
+		nr_cpus = cpumask_weight(&c->cpus);
+	}
+
+	total = c->hist.n * nr_cpus;
+	c->pass = true;
+	for (size_t p = 0; p < NR_INSTRUMENTED; ++p) {
+		const u64 instr = hist_median(c->hist.count[p], total);
+		const u64 raw = hist_median(c->hist.count[raw_primitive(p)], total);
+
+		c->delta[p] = instr > raw ? instr - raw : 0;
+		if (c->delta[p] > threshold)
+			c->pass = false;
+	}
+
+	ret = single_open(file, canary_show, c);
+	if (!ret)
+		c = NULL;
+
+	return ret;
+}
+
+static const struct file_operations canary_fops = {
+	.owner		= THIS_MODULE,
+	.open		= canary_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= hist_release,
+};
+
 struct debugfs_config {
 	const char *filename;
 	const struct file_operations *fops;
@@ -627,6 +3068,16 @@ static const struct debugfs_config configs[] = {
 	CONFIG_ENTRY(nr_samples),
 	CONFIG_ENTRY(nr_highest),
 	CONFIG_ENTRY(nth_percentile),
+	CONFIG_ENTRY(nr_ref_probes),
+	CONFIG_ENTRY(lock_group_size),
+	CONFIG_ENTRY(canary_samples),
+	CONFIG_ENTRY(canary_cpus),
+	CONFIG_ENTRY(canary_threshold),
+	CONFIG_ENTRY(sched_priority),
+	CONFIG_ENTRY(dl_runtime_us),
+	CONFIG_ENTRY(dl_period_us),
+	CONFIG_ENTRY(chunk_us),
+	CONFIG_ENTRY(duty_cycle),
 };
 
 static void __init create_config_files(struct dentry *parent)
@@ -634,29 +3085,121 @@ static void __init create_config_files(struct dentry *parent)
 	for (size_t i = 0; i < ARRAY_SIZE(configs); ++i)
 		debugfs_create_file_unsafe(configs[i].filename, 0644,
 					   parent, NULL, configs[i].fops);
+	debugfs_create_file("consumer", 0644, parent, &consumer, &choice_fops);
+	debugfs_create_file("attach", 0644, parent, &attach, &choice_fops);
+	debugfs_create_file("clock_source", 0644, parent, &clock_source,
+			    &choice_fops);
+	debugfs_create_file("sched_policy", 0644, parent, &sched_policy,
+			    &choice_fops);
+	debugfs_create_file("lock_placement", 0644, parent, &lock_placement,
+			    &choice_fops);
 	debugfs_create_bool("do_work", 0644, parent, &do_work);
+	debugfs_create_bool("expect_traced", 0644, parent, &expect_traced);
+	debugfs_create_bool("latency_tracer", 0644, parent, &latency_tracer);
+	debugfs_create_bool("irq_pending", 0644, parent, &irq_pending.val);
+	debugfs_create_bool("resched_pending", 0644, parent, &resched_pending.val);
+	debugfs_create_bool("bh_pending", 0644, parent, &bh_pending.val);
+	debugfs_create_bool("hardirq_sampling", 0644, parent, &hardirq_sampling.val);
+	debugfs_create_bool("softirq_sampling", 0644, parent, &softirq_sampling.val);
+}
+
+
+static int completed_cpus_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "%*pbl\n", cpumask_pr_args(&completed_cpus));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(completed_cpus);
+
+/* One "cpu voluntary involuntary" line per completed CPU */
+static int context_switches_show(struct seq_file *m, void *v)
+{
+	unsigned int cpu;
+
+	for_each_cpu(cpu, &completed_cpus) {
+		const struct percpu_data *my_data = per_cpu_ptr(&data, cpu);
+
+		seq_printf(m, "%u %llu %llu\n", cpu, my_data->nvcsw,
+			   my_data->nivcsw);
+	}
+
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(context_switches);
+
+/* One "cpu status samples" line per CPU that was online for the last run */
+static int participation_show(struct seq_file *m, void *v)
+{
+	unsigned int cpu;
 
+	for_each_possible_cpu(cpu) {
+		const struct percpu_data *my_data = per_cpu_ptr(&data, cpu);
+
+		if (my_data->status == PART_IDLE)
+			continue;
+
+		seq_printf(m, "%u %s %zu\n", cpu,
+			   participation_names[my_data->status],
+			   my_data->status == PART_COMPLETED ||
+			   my_data->status == PART_REDUCED ? my_data->nr_samples : 0);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(participation);
 
 static int __init create_stat_files(struct dentry *parent)
 {
 	static const umode_t mode = 0444;
+	struct dentry *ctx_dirs[NR_CONTEXTS] = { [CTX_TASK] = parent };
 	struct dentry *subdir;
 
-	for (size_t i = 0; i < ARRAY_SIZE(debugfs_result_files); ++i) {
-		const struct debugfs_results *entries = debugfs_result_files + i;
+	for (size_t c = CTX_TASK + 1; c < NR_CONTEXTS; ++c) {
+		ctx_dirs[c] = debugfs_create_dir(context_names[c], parent);
+		if (IS_ERR(ctx_dirs[c]))
+			return PTR_ERR(ctx_dirs[c]);
+	}
 
-		subdir = debugfs_create_dir(entries->subdir, parent);
+	for (size_t p = 0; p < NR_PRIMITIVES; ++p) {
+		subdir = debugfs_create_dir(primitive_names[p],
+					    ctx_dirs[primitive_context(p)]);
 		if (IS_ERR(subdir))
 			return PTR_ERR(subdir);
 
-		for (size_t j = 0; j < ARRAY_SIZE(entries->values); ++j) {
-			const struct debugfs_entry *entry = entries->values + j;
+		for (size_t j = 0; j < ARRAY_SIZE(debugfs_stat_files); ++j) {
+			const struct debugfs_entry *entry = debugfs_stat_files + j;
+
+			debugfs_create_u64(entry->filename, mode, subdir,
+					   (void *)&stats[p] + entry->offset);
+		}
 
-			debugfs_create_u64(entry->filename, mode, subdir, entry->value);
+		if (p < NR_INSTRUMENTED) {
+			debugfs_create_u64("instrumentation_delta", mode, subdir,
+					   &instrumentation_delta[p]);
+			debugfs_create_u64("tp_expected", mode, subdir,
+					   &tp_expected[p]);
+			debugfs_create_u64("tp_observed", mode, subdir,
+					   &tp_observed[p]);
 		}
+
+		if (is_slow_path(p))
+			debugfs_create_u64("missed", mode, subdir, &missed[p]);
 	}
 
+	debugfs_create_u64("attach_sites", mode, parent, &attach_sites);
+	debugfs_create_u64("traced", mode, parent, &traced);
+	debugfs_create_u64("trace_mismatch", mode, parent, &trace_mismatch);
+	debugfs_create_u64("pmu_clock", mode, parent, &pmu_clock);
+	debugfs_create_u64("startup_latency", mode, parent, &startup_latency);
+	debugfs_create_file("completed_cpus", mode, parent, NULL,
+			    &completed_cpus_fops);
+	debugfs_create_file("context_switches", mode, parent, NULL,
+			    &context_switches_fops);
+	debugfs_create_u64("yields", mode, parent, &yields);
+	debugfs_create_u64("participating_cpus", mode, parent, &participating_cpus);
+	debugfs_create_file("participation", mode, parent, NULL,
+			    &participation_fops);
+
 	return 0;
 }
 
@@ -665,14 +3208,35 @@ static struct dentry *rootdir;
 static int __init mod_init(void)
 {
 	struct dentry *file;
+	unsigned int cpu;
 	int ret;
 
 	compiletime_assert(sizeof(u64)*NR_STATISTICS == sizeof(struct statistics),
 			   "struct statistics size is not multiple of u64");
 
+	for_each_kernel_tracepoint(lookup_tracepoint, NULL);
+
+	for_each_possible_cpu(cpu) {
+		tasklet_setup(per_cpu_ptr(&bh_pending_tasklet, cpu), bh_pending_fn);
+		tasklet_setup(per_cpu_ptr(&softirq_tasklet, cpu), softirq_block_fn);
+	}
+
+	/* the sample file relies on the slots of the mandatory primitives */
+	setup_sample_slots();
+
+	/*
+	 * The threads sleep until a run sets their should_run.  They must
+	 * exist before any debugfs file lets a run start.
+	 */
+	ret = smpboot_register_percpu_thread(&sample_thread);
+	if (ret)
+		return ret;
+
 	rootdir = debugfs_create_dir(KBUILD_MODNAME, NULL);
-	if (IS_ERR(rootdir))
-		return PTR_ERR(rootdir);
+	if (IS_ERR(rootdir)) {
+		ret = PTR_ERR(rootdir);
+		goto err_threads;
+	}
 
 	file = debugfs_create_file("benchmark", 0200, rootdir, NULL, &benchmark_fops);
 	if (IS_ERR(file)) {
@@ -680,6 +3244,18 @@ static int __init mod_init(void)
 		goto err;
 	}
 
+	file = debugfs_create_file("sample", 0600, rootdir, NULL, &sample_fops);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto err;
+	}
+
+	file = debugfs_create_file("canary", 0400, rootdir, NULL, &canary_fops);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto err;
+	}
+
 	create_config_files(rootdir);
 	ret = create_stat_files(rootdir);
 	if (ret)
@@ -689,12 +3265,15 @@ static int __init mod_init(void)
 
 err:
 	debugfs_remove_recursive(rootdir);
+err_threads:
+	smpboot_unregister_percpu_thread(&sample_thread);
 	return ret;
 }
 
 static void __exit mod_exit(void)
 {
 	debugfs_remove_recursive(rootdir);
+	smpboot_unregister_percpu_thread(&sample_thread);
 }
 
 module_init(mod_init);
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Reference tracepoints for tracerbench.
+ *
+ * These events have the same arguments and record layout as the
+ * preemptirq_template events (irq_disable, preempt_disable, ...), so
+ * firing them measures the generic tracepoint machinery without the
+ * preemptirq hooks around it.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tracerbench
+
+#if !defined(_TRACERBENCH_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACERBENCH_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <asm/sections.h>
+
+DECLARE_EVENT_CLASS(tracerbench_ref_template,
+
+	TP_PROTO(unsigned long ip, unsigned long parent_ip),
+
+	TP_ARGS(ip, parent_ip),
+
+	TP_STRUCT__entry(
+		__field(s32, caller_offs)
+		__field(s32, parent_offs)
+	),
+
+	TP_fast_assign(
+		__entry->caller_offs = (s32)(ip - (unsigned long)_stext);
+		__entry->parent_offs = (s32)(parent_ip - (unsigned long)_stext);
+	),
+
+	TP_printk("caller=%pS parent=%pS",
+		  (void *)((unsigned long)(_stext) + __entry->caller_offs),
+		  (void *)((unsigned long)(_stext) + __entry->parent_offs))
+);
+
+/* Never has a probe attached by the module */
+DEFINE_EVENT(tracerbench_ref_template, tracerbench_ref0,
+	     TP_PROTO(unsigned long ip, unsigned long parent_ip),
+	     TP_ARGS(ip, parent_ip));
+
+/* Has one empty probe attached during benchmark runs */
+DEFINE_EVENT(tracerbench_ref_template, tracerbench_ref1,
+	     TP_PROTO(unsigned long ip, unsigned long parent_ip),
+	     TP_ARGS(ip, parent_ip));
+
+/* Has nr_ref_probes empty probes attached during benchmark runs */
+DEFINE_EVENT(tracerbench_ref_template, tracerbench_refn,
+	     TP_PROTO(unsigned long ip, unsigned long parent_ip),
+	     TP_ARGS(ip, parent_ip));
+
+#endif /* _TRACERBENCH_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tracerbench_trace
+#include <trace/define_trace.h>